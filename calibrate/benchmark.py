@@ -0,0 +1,213 @@
+#! /usr/bin/python3
+
+#
+# Measure how long it takes to capture a crash dump, from the start of
+# the kdump kernel until the dump is complete.
+#
+# The kdump initrd is booted in the calibration VM, once with a local
+# disk and once with a loopback ssh target. The kernel log timestamps of
+# well-known boot messages and of the phase markers written by
+# kdump-save are collected into a JSON file.
+#
+
+import sys
+import os
+import re
+import json
+import time
+import argparse
+import tempfile
+
+from calibvm import boot_qemu, build_elfcorehdr, build_initrd, \
+    check_disk_dump, dump_ok, elfcorehdr_address, init_local_dracut, \
+    install_kdump_init, kernel_images, kernel_version, make_disk, \
+    start_sshd, write_net_config
+
+# Version of the output format
+FORMAT = 1
+
+# Phases in the order they finish, with the message that ends them
+PHASES = (
+    ('kernel', 'Trying to unpack rootfs image'),
+    ('initrd', 'Freeing initrd memory'),
+    ('udev', 'kdump: phase start'),
+    ('prescript', 'kdump: phase prescript'),
+    ('network', 'kdump: phase net'),
+    ('readme', 'kdump: phase readme'),
+    ('dmesg', 'kdump: phase dmesg'),
+    ('triage', 'kdump: phase triage'),
+    ('vmcore', 'kdump: phase vmcore'),
+    ('freespace', 'kdump: phase freespace'),
+    ('sync', 'kdump: phase sync'),
+    ('postscript', 'kdump: phase postscript'),
+)
+
+# Phases that kdump-save runs in the background, with the message that
+# ends them; they overlap the phases above
+BACKGROUND = (
+    ('read-dmesg', 'kdump: phase read-dmesg'),
+    ('prune', 'kdump: phase prune'),
+)
+
+re_stamp = re.compile(r'\[\s*(\d+\.\d+)\] (.*)$')
+
+params = dict()
+
+def parse_phases(path):
+    stamps = dict()
+    with open(path, errors='replace') as f:
+        for line in f:
+            match = re_stamp.search(line.rstrip())
+            if not match:
+                continue
+            for (name, message) in PHASES + BACKGROUND:
+                if name not in stamps and match[2].startswith(message):
+                    stamps[name] = float(match[1])
+    return stamps
+
+def durations(stamps):
+    result = dict()
+    prev = 0.0
+    for (name, message) in PHASES:
+        if name in stamps:
+            result[name] = round(stamps[name] - prev, 6)
+            prev = stamps[name]
+    return result
+
+def write_config(path, base):
+    # Time the dump as it is normally run, without debugging output
+    with open(path, 'w') as f:
+        f.write('. {}\n'.format(base))
+        f.write('KDUMP_VERBOSE=0\n')
+        f.write('KDUMP_PRESCRIPT=\n')
+        if cmdline.net_streams is not None:
+            f.write('KDUMP_NET_STREAMS={}\n'.format(cmdline.net_streams))
+
+def benchmark_run(net):
+    bindir = params['BINDIR']
+    params['NET'] = net
+
+    with tempfile.TemporaryDirectory(prefix='benchmark-') as rundir:
+        os.chdir(rundir)
+        elfcorehdr = build_elfcorehdr(bindir,
+                                      elfcorehdr_address(params['ARCH']),
+                                      params=params)
+        install_kdump_init(bindir)
+        init_local_dracut(params)
+        config = os.path.join(rundir, 'benchmark.conf')
+
+        sshd = None
+        if net:
+            dumpdir = os.path.join(rundir, 'netdump')
+            os.mkdir(dumpdir)
+            (sshd, port, identity) = start_sshd(rundir)
+            base = os.path.join(rundir, 'net.conf')
+            write_net_config(base,
+                             os.path.join(params['SCRIPTDIR'], 'dummy-net.conf'),
+                             port, identity, dumpdir)
+        else:
+            make_disk('disk.raw')
+            base = os.path.join(params['SCRIPTDIR'], 'dummy.conf')
+        write_config(config, base)
+
+        try:
+            initrd = build_initrd(bindir, params, config, 'benchmark-initrd')
+            start = time.monotonic()
+            boot_qemu(bindir, params, initrd, elfcorehdr)
+            elapsed = time.monotonic() - start
+        finally:
+            if sshd:
+                sshd.terminate()
+                sshd.wait()
+
+        if net:
+            ok = dump_ok(dumpdir)
+        else:
+            ok = check_disk_dump('disk.raw')
+        stamps = parse_phases(params['MESSAGES_LOG'])
+        os.chdir(params['BINDIR'])
+
+    return {
+        'ok': ok,
+        'timestamps': stamps,
+        'durations': durations(stamps),
+        'vm_seconds': round(elapsed, 3),
+    }
+
+################################################
+# main program
+
+parser = argparse.ArgumentParser()
+parser.add_argument('-o', '--output', default='benchmark.json',
+                    help='where to write the results')
+parser.add_argument('-k', '--kernel',
+                    help='kernel image to boot (default: first in /boot)')
+parser.add_argument('--elf-cpus', type=int, metavar='N',
+                    help='number of CPUs in the crashed system')
+parser.add_argument('--elf-memory', metavar='SIZE',
+                    help='memory size of the crashed system, e.g. 4T; '
+                    'only the capture kernel sees it, makedumpfile still '
+                    'saves /proc/kcore')
+parser.add_argument('--net-streams', type=int, metavar='N',
+                    help='parallel uploads to the network target '
+                    '(default: KDUMP_NET_STREAMS default)')
+cmdline = parser.parse_args()
+
+params['SCRIPTDIR'] = os.path.abspath(os.path.dirname(sys.argv[0]))
+params['BINDIR'] = os.getcwd()
+params['KDUMP_LIBDIR'] = os.path.abspath(params['SCRIPTDIR'] + "/..")
+params['DRACUTDIR'] = '/usr/lib/dracut'
+params['TOTAL_RAM'] = 1024 * 1024
+params['NUMCPUS'] = 2
+params['MESSAGES_LOG'] = 'messages.log'
+params['TRACKRSS_LOG'] = 'trackrss.log'
+params['TRACKRSS_PORT_LOG'] = 'trackrss-port.log'
+params['ARCH'] = os.uname()[4]
+
+# Boot the real init; trackrss would add its own overhead
+params['TRACKRSS'] = False
+
+if cmdline.elf_cpus:
+    params['ELF_CPUS'] = cmdline.elf_cpus
+if cmdline.elf_memory:
+    params['ELF_MEMORY'] = cmdline.elf_memory
+
+if cmdline.kernel:
+    params['KERNEL'] = cmdline.kernel
+else:
+    kernels = kernel_images(params['ARCH'])
+    if not kernels:
+        print('No kernel found in /boot', file=sys.stderr)
+        exit(1)
+    params['KERNEL'] = kernels[0]
+params['KERNELVER'] = kernel_version(params['KERNEL'])
+
+output = {
+    'format': FORMAT,
+    'arch': params['ARCH'],
+    'kernel': params['KERNELVER'],
+    'memory_kb': params['TOTAL_RAM'],
+    'cpus': params['NUMCPUS'],
+    'net_streams': cmdline.net_streams,
+    'runs': {
+        'local': benchmark_run(False),
+        'network': benchmark_run(True),
+    },
+}
+
+with open(cmdline.output, 'w') as f:
+    json.dump(output, f, indent=2, sort_keys=True)
+    f.write('\n')
+
+failed = False
+for (name, run) in sorted(output['runs'].items()):
+    total = run['timestamps'].get('sync')
+    if not run['ok'] or total is None:
+        print('{} capture failed'.format(name), file=sys.stderr)
+        failed = True
+    else:
+        print('{} capture: {:.3f} s'.format(name, total), file=sys.stderr)
+
+exit(1 if failed else 0)
+
+# vim: set et ts=4 sw=4 :
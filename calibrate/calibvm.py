@@ -0,0 +1,526 @@
+#
+# Shared code to run a kdump initrd under QEMU and measure its memory usage.
+# Used by run-qemu.py at build time and by kdumptool calibrate --measure.
+#
+
+import sys
+import os
+import subprocess
+import shutil
+import glob
+import socket
+
+# Name of the virtio serial port for trackrss output
+TRACKRSS_PORT = 'org.opensuse.kdump.trackrss'
+
+def install_kdump_init(bindir):
+    env = os.environ.copy()
+    env['DESTDIR'] = os.path.abspath('.')
+    args = (
+        'cmake',
+        '--install', os.path.join(bindir, '..', 'dracut'),
+    )
+    subprocess.call(args, env=env, stdout=sys.stderr)
+
+def init_local_dracut(params):
+    basedir = params['DRACUTDIR']
+    os.symlink(shutil.which('dracut'), 'dracut')
+    for name in os.listdir(basedir):
+        if name == 'modules.d':
+            os.mkdir(name)
+            for module in os.listdir(os.path.join(basedir, name)):
+                dst = os.path.join(name, module)
+                if module[2:] != 'kdump':
+                    os.symlink(os.path.join(basedir, dst), dst)
+
+            dst = os.path.join(name, '99kdump')
+            os.symlink(os.path.join('..', basedir[1:], dst), dst)
+        else:
+            os.symlink(os.path.join(basedir, name), name)
+
+def build_initrd(bindir, params, config, path):
+        # First, create the base initrd using dracut:
+        env = os.environ.copy()
+        if 'KDUMP_LIBDIR' in params:
+            env['KDUMP_LIBDIR'] = params['KDUMP_LIBDIR']
+        env['KDUMP_CONF'] = os.path.join(params['SCRIPTDIR'], config)
+        env['DRACUT_PATH'] = ' '.join((
+            '/sbin',
+            '/bin',
+            '/usr/sbin',
+            '/usr/bin'))
+
+        drivers = []
+        if params['NET']:
+            drivers.append('af_packet')
+            if params['ARCH'].startswith('s390'):
+                drivers.append('virtio-net')
+            else:
+                drivers.append('e1000e')
+            extra_args = []
+        else:
+            drivers.append('sd_mod')
+            drivers.append('virtio_blk')
+            drivers.append('ext4')
+            extra_args = ('--mount', '/dev/disk/by-label/calib-disk /kdump/mnt ext3')
+        if params.get('LOCAL_DRACUT', True):
+            dracut = (os.path.abspath('dracut'), '--local')
+        else:
+            dracut = (shutil.which('dracut'),)
+        args = (
+            *dracut,
+            '--hostonly',
+            '--no-hostonly-default-device',
+
+            # Standard kdump initrd options:
+            '--omit', 'plymouth resume usrmount',
+            '--add', 'kdump',
+
+            # Create a simple uncompressed CPIO archive:
+            '--no-compress',
+            '--no-early-microcode',
+            '--add-drivers', ' '+' '.join(drivers),
+            # Additional options:
+            *extra_args,
+
+            path,
+            params['KERNELVER'],
+        )
+        subprocess.call(args, env=env, stdout=sys.stderr)
+
+        # Replace /init with trackrss:
+        if params.get('TRACKRSS', True):
+            trackrss = os.path.join(bindir, 'trackrss')
+            shutil.copy(trackrss, './init')
+            args =(
+                'cpio', '-o',
+                '-H', 'newc',
+                '--owner=0:0',
+                '--append', '--file=' + path,
+            )
+            with subprocess.Popen(args, stdin=subprocess.PIPE) as p:
+                p.communicate(b'init')
+
+        # Compress the result:
+        subprocess.call(('xz', '-f', '-0', '--check=crc32', path))
+        return path + os.path.extsep + 'xz'
+
+class build_elfcorehdr(object):
+    def __init__(self, bindir, addr, path='elfcorehdr.bin', params=dict()):
+        self.address = addr
+        self.path = path
+
+        # Optionally describe a larger crashed system. The memory is
+        # never read, so all PT_LOADs alias the elfcorehdr itself. This
+        # loads the /proc/vmcore setup of the capture kernel, but not
+        # makedumpfile, which saves /proc/kcore.
+        layout = []
+        if 'ELF_CPUS' in params:
+            layout.extend(('--cpus', str(params['ELF_CPUS'])))
+        if 'ELF_MEMORY' in params:
+            layout.extend(('--memory', params['ELF_MEMORY'],
+                           '--backing', str(addr)))
+        if 'ELF_RANGES' in params:
+            layout.extend(('--ranges', str(params['ELF_RANGES'])))
+
+        mkelfcorehdr = os.path.join(bindir, 'mkelfcorehdr')
+        args = (
+            mkelfcorehdr,
+            *layout,
+            path,
+            str(addr),
+        )
+        subprocess.call(args)
+
+        self.size = (os.stat(self.path).st_size + 1023) // 1024
+
+def qemu_name(machine):
+    if machine == 'aarch64_be':
+        machine = 'aarch64'
+    elif machine == 'armv8b' or machine == 'armv8l':
+        machine = 'arm'
+    if machine == 'i586' or machine == 'i686':
+        machine = 'i386'
+    if machine == 'ppcle':
+        machine = 'ppc'
+    elif machine == 'ppc64le':
+        machine = 'ppc64'
+    return 'qemu-system-' + machine
+
+def boot_qemu(bindir, params, initrd, elfcorehdr):
+    arch = params['ARCH']
+    extra_qemu_args = []
+    extra_kernel_args = []
+
+    # Set up console tty and a serial port for trackrss
+    if arch.startswith('ppc'):
+        console = 'hvc0'
+        logdev = '229,1'        # hvc1
+    elif arch.startswith('s390'):
+        console = 'sclp0'
+        logdev = '229,0'        # hvc0
+    elif arch == 'riscv64':
+        console = 'ttyS1'
+        logdev = '4,66'         # ttyS2
+    else:
+        console = 'ttyS0'
+        logdev = '4,65'         # ttyS1
+
+    if arch == 'aarch64':
+        console_args = (
+            '-serial', 'null',  # ttyAMA0 (used for OVMF debug messages)
+            '-chardev', 'file,path={},id=ttyS0'.format(params['MESSAGES_LOG']),
+            '-chardev', 'file,path={},id=ttyS1'.format(params['TRACKRSS_LOG']),
+            '-device', 'pci-serial-2x,chardev1=ttyS0,chardev2=ttyS1',
+            )
+    elif arch.startswith('s390'):
+        console_args = (
+            '-serial', 'file:' + params['MESSAGES_LOG'],
+            '-device', 'virtio-serial-ccw',
+            '-chardev', 'file,path={},id=hvc0'.format(params['TRACKRSS_LOG']),
+            '-device', 'virtconsole,nr=0,chardev=hvc0',
+            )
+    elif arch == 'riscv64':
+        console_args = (
+            '-serial', 'mon:stdio',  # one serial port is hardcoded in the virt machine
+            '-chardev', 'file,path={},id=ttyS1'.format(params['MESSAGES_LOG']),
+            '-chardev', 'file,path={},id=ttyS2'.format(params['TRACKRSS_LOG']),
+            '-device', 'pci-serial-2x,chardev1=ttyS1,chardev2=ttyS2',
+            )
+    else:
+        console_args = (
+            '-serial', 'file:' + params['MESSAGES_LOG'],
+            '-serial', 'file:' + params['TRACKRSS_LOG'],
+        )
+
+    # A virtio serial port is much faster than an emulated UART.
+    # trackrss falls back to the serial port if the guest kernel
+    # cannot use it. On s390 the serial port is already virtio.
+    trackrss_args = ['trackrss={}'.format(logdev)]
+    # Checkpoints preserve the peak if the guest dies before the summary
+    trackrss_args.append('trackrss.checkpoint=1000')
+    if not params.get('TRACKRSS', True):
+        trackrss_args = []
+    elif not arch.startswith('s390'):
+        console_args = (
+            *console_args,
+            '-device', 'virtio-serial-pci',
+            '-chardev', 'file,path={},id=trackrss'.format(
+                params['TRACKRSS_PORT_LOG']),
+            '-device', 'virtserialport,chardev=trackrss,name={}'.format(
+                TRACKRSS_PORT),
+        )
+        trackrss_args.append('trackrss=port:{}'.format(TRACKRSS_PORT))
+
+    qemu_ram = params['TOTAL_RAM']
+    # Set up ELF core headers
+    if arch.startswith('s390'):
+        S390_OLDMEM_BASE = 0x10418 # cf. struct parmarea
+        oldmem = 'oldmem.bin'
+        # memory size for the crash kernel is defined by oldmem_size;
+        # put it in the middle of a doubled qemu memory
+        oldmem_size = qemu_ram * 1024;
+        oldmem_base = int(qemu_ram * 1024 / 2)
+        qemu_ram *= 2
+        with open(oldmem, 'wb') as f:
+            f.write(oldmem_base.to_bytes(8, 'big'))
+            f.write(oldmem_size.to_bytes(8, 'big'))
+        extra_qemu_args.extend((
+            '-device', 'loader,addr=0x{:x},file={}'.format(
+                S390_OLDMEM_BASE, oldmem),
+        ))
+    else:
+        extra_kernel_args.append(
+            'elfcorehdr=0x{0:x} crashkernel={1:d}K@0x{0:x}'.format(
+                elfcorehdr.address, elfcorehdr.size))
+
+    # Kernel and QEMU arguments to congifure network
+    if params['NET']:
+        if arch.startswith('s390'):
+            model = 'virtio'
+        else:
+            model = 'e1000e'
+        mac = '12:34:56:78:9A:BC'
+        extra_qemu_args.extend((
+            '-nic', 'user,mac={},model={}'.format(mac, model)
+        ))
+        extra_kernel_args.extend((
+            'ifname=kdump0:{}'.format(mac),
+            'ip=kdump0:dhcp',
+            'rd.neednet=1'
+        ))
+    else:
+        extra_qemu_args.extend((
+            '-drive', 'file=disk.raw,index=0,media=disk,if=virtio',
+        ))
+
+    # Other arch-specific arguments
+    if arch == 'aarch64':
+        extra_qemu_args.extend((
+            '-machine', 'virt',
+            '-cpu', 'cortex-a57',
+            '-bios', '/usr/share/qemu/qemu-uefi-aarch64.bin',
+        ))
+    if arch == 'x86_64':
+        extra_qemu_args.extend((
+            '-cpu', 'max',
+        ))
+    if arch == 'riscv64':
+        extra_qemu_args.extend((
+            '-machine', 'virt',
+        ))
+
+    kernel_args = (
+        'panic=1',
+        'nokaslr',
+        'printk.time=1',
+        'console={}'.format(console),
+        'root=kdump',
+        'rootflags=bind',
+        'rd.shell=0',
+        'rd.emergency=poweroff',
+        *extra_kernel_args,
+        *(('--', *trackrss_args) if trackrss_args else ()),
+    )
+    qemu_args = (
+        qemu_name(arch),
+        '-smp', str(params['NUMCPUS']),
+        '-no-reboot',
+        '-m', '{:d}K'.format(qemu_ram),
+        '-nographic',
+        *console_args,
+        '-kernel', params['KERNEL'],
+        '-initrd', initrd,
+        '-append', ' '.join(kernel_args),
+        '-device', 'loader,file={},force-raw=on,addr=0x{:x}'.format(
+            elfcorehdr.path, elfcorehdr.address),
+        *extra_qemu_args,
+    )
+
+    # create the log files and monitor them with tail -f 
+    # (redirected to stderr)
+    # for debugging possible problems inside the VM
+    f = open(params['MESSAGES_LOG'], "w")
+    f.close()
+    tail_messages = subprocess.Popen(["tail", "-f", params['MESSAGES_LOG']], stdout=2)
+    
+    f = open(params['TRACKRSS_LOG'], "w")
+    f.close()
+    f = open(params['TRACKRSS_PORT_LOG'], "w")
+    f.close()
+
+    subprocess.run(qemu_args, stdout=sys.stderr, stderr=sys.stderr, check=True)
+
+    tail_messages.kill()
+
+def run_qemu(bindir, params, initrd, elfcorehdr):
+    boot_qemu(bindir, params, initrd, elfcorehdr)
+
+    # use whichever channel trackrss has chosen
+    trackrss_log = params['TRACKRSS_PORT_LOG']
+    if os.path.getsize(trackrss_log) == 0:
+        trackrss_log = params['TRACKRSS_LOG']
+
+    print("trackrss output:", file=sys.stderr)
+    subprocess.run(['cat', trackrss_log], stdout=2)
+    print("(end of trackrss output)", file=sys.stderr)
+
+    results = dict()
+
+    # Get kernel-space requirements
+    script = os.path.join(params['SCRIPTDIR'], 'kernel.py')
+    with subprocess.Popen(script,
+                          stdin=open(params['MESSAGES_LOG']),
+                          stdout=subprocess.PIPE) as p:
+        for line in p.communicate()[0].decode().splitlines():
+            (key, val) = line.strip().split('=')
+            results[key] = int(val)
+
+    # Get user-space requirements
+    script = os.path.join(params['SCRIPTDIR'], 'maxrss.py')
+    with subprocess.Popen(script,
+                          stdin=open(trackrss_log),
+                          stdout=subprocess.PIPE) as p:
+        for line in p.communicate()[0].decode().splitlines():
+            (key, val) = line.strip().split('=')
+            results[key] = int(val)
+
+    # The MEMMAP array is accounted separately
+    pagesize = results['PAGESIZE']
+    pagesize_kb = pagesize // 1024
+    numpages = (params['TOTAL_RAM'] + pagesize_kb - 1) // pagesize_kb
+    memmap_pages = (numpages * results['SIZEOFPAGE'] + pagesize - 1) // pagesize
+    memmap_kb = memmap_pages * pagesize_kb
+
+    if 'LOW_MEMFREE' in results:
+        # Kernel memory at the MemFree low-water mark, i.e. the true peak.
+        # Page cache (including the initramfs) and anonymous user memory
+        # are accounted separately.
+        kernel_base = params['TOTAL_RAM'] - results['LOW_MEMFREE']
+        kernel_base -= results['LOW_CACHED'] + results['LOW_ANON']
+
+        # Buffer heads and unreclaimable slab which grew while writing
+        # the dump are in-flight I/O, scaled with the dirty pages
+        inflight = results['LOW_BUFFERS'] + results['LOW_SUNRECLAIM_GROWTH']
+        kernel_base -= inflight
+
+        # Kernel stacks and page tables of the processes started since
+        # boot, including the dump threads; calibrate.cc adds a thread
+        # footprint for each CPU instead
+        kernel_base -= results['LOW_PROC_GROWTH']
+
+        # The in-flight I/O per dirty MiB is measured. DIRTY_RATIO is
+        # not: kdump-write limits the dirty pages to its write-back
+        # windows, so this VM never reaches the dirty limit, and
+        # calibrate.cc keeps the kernel default.
+        if results['LOW_DIRTY'] >= 1024:
+            results['BUF_PER_DIRTY_MB'] = (
+                (inflight * 1024 + results['LOW_DIRTY'] - 1) //
+                results['LOW_DIRTY'])
+    else:
+        # No samples; use the snapshot taken before systemd started
+        kernel_base = params['TOTAL_RAM'] - results['INIT_MEMFREE']
+        # The above also includes the unpacked initramfs, which should be separate
+        kernel_base -= results['INIT_CACHED']
+    kernel_base -= memmap_kb
+    results['KERNEL_BASE'] = kernel_base - results['PERCPU']
+
+    results['PERCPU'] = results['PERCPU'] // params['NUMCPUS']
+
+    return results
+
+def kernel_images(arch):
+    if arch == "i386" or arch == "i586" or arch == "i686" or arch == "x86_64":
+        image="vmlinuz"
+    elif arch.startswith("s390"):
+        image="image"
+    elif arch == "aarch64" or arch == "riscv64":
+        image="Image"
+    else:
+        image="vmlinux"
+    return sorted(glob.glob("/boot/"+image+"-*"))
+
+def free_port():
+    # The port may be taken again before sshd binds it, but sshd
+    # then fails loudly and the run is not silently mixed up.
+    with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
+        s.bind(('', 0))
+        return s.getsockname()[1]
+
+def start_sshd(rundir):
+    # A private sshd for each run, so that runs cannot collide on the
+    # port, the host key or the authorized keys.
+    quiet = dict(stdout=sys.stderr, stderr=sys.stderr, check=True)
+    hostkey = os.path.join(rundir, 'ssh_host_ed25519_key')
+    identity = os.path.join(rundir, 'id_ed25519')
+    subprocess.run(('ssh-keygen', '-q', '-t', 'ed25519', '-N', '',
+                    '-f', hostkey), **quiet)
+    subprocess.run(('ssh-keygen', '-q', '-t', 'ed25519', '-N', '',
+                    '-f', identity), **quiet)
+    authorized_keys = os.path.join(rundir, 'authorized_keys')
+    shutil.copy(identity + '.pub', authorized_keys)
+
+    port = free_port()
+    args = (
+        '/usr/sbin/sshd', '-D', '-e',
+        '-f', '/dev/null',
+        '-p', str(port),
+        '-h', hostkey,
+        '-o', 'AuthorizedKeysFile=' + authorized_keys,
+        '-o', 'PermitRootLogin=prohibit-password',
+        '-o', 'StrictModes=no',
+        '-o', 'PidFile=none',
+        '-o', 'Subsystem=sftp internal-sftp',
+    )
+    sshd = subprocess.Popen(args, stdout=sys.stderr, stderr=sys.stderr)
+    return (sshd, port, identity)
+
+def write_net_config(path, base, port, identity, dumpdir):
+    # Point the network dump at a private sshd and dump directory
+    with open(path, 'w') as f:
+        f.write('. {}\n'.format(base))
+        f.write('KDUMP_SAVEDIR="sftp://root@10.0.2.2:{}{}"\n'.format(
+            port, dumpdir))
+        f.write('KDUMP_SSH_IDENTITY="{}"\n'.format(identity))
+
+def calc_diff(src, dst, key, diffkey):
+    src[diffkey] = max(0, dst[key] - src[key])
+
+def dump_ok(crashdir):
+    if not os.path.isdir(crashdir):
+        print(crashdir + " does not exist", file=sys.stderr)
+        return False
+
+    with os.scandir(crashdir) as it:
+        for entry in it:
+            if not entry.name.startswith('.') and entry.is_dir():
+                print("found dump directory: " + entry.path, file=sys.stderr)
+                # a vmcore uploaded over multiple connections is striped,
+                # and one uploaded in segments has a manifest
+                if not any(os.path.isfile(os.path.join(entry.path, name))
+                           for name in ('vmcore', 'vmcore.0', 'vmcore.manifest')):
+                    print("vmcore not found", file=sys.stderr)
+                    return False
+                
+                if not os.path.isfile(os.path.join(entry.path, 'README.txt')):
+                    print("README.txt not found", file=sys.stderr)
+                    return False
+
+                try:
+                    f = open(os.path.join(entry.path, 'README.txt'),"r")
+                    readme = f.read()
+                    if not 'vmcore status: saved successfully' in readme:
+                        print("README.txt does not contain vmcore success status", file=sys.stderr)
+                        return False
+                except:
+                    print("can't read README.txt", file=sys.stderr)
+                    return False 
+                print("vmcore and README.txt check OK", file=sys.stderr)
+                return True
+    return False
+
+def elfcorehdr_address(arch):
+    # Physical address where elfcorehdr should be loaded.
+    # This is tricky. The elfcorehdr memory range is removed from the kernel
+    # memory map with a command line option, but the kernel boot code runs
+    # before the command line is parsed, and it may overwrite the data.
+    if arch == 'aarch64':
+        # QEMU defines all RAM at 1G physical for AArch64
+        return (1024 * 1024 * 1024) + (256 * 1024 * 1024)
+    elif arch == 'riscv64':
+        # QEMU defines all RAM at 2G physical for RISC-V
+        return 0x80000000 + (256 * 1024 * 1024)
+    else:
+        # For other platforms, the region at 768M should be reasonably safe,
+        # because it is high enough to avoid conflicts with special-purpose
+        # regions and low enough to avoid conflicts with allocations at the
+        # end of RAM.
+        return 768 * 1024 * 1024
+
+def kernel_version(image):
+    with subprocess.Popen(('get_kernel_version', image),
+                          stdout=subprocess.PIPE) as p:
+        return p.communicate()[0].decode().strip()
+
+def make_disk(path, label='calib-disk'):
+    subprocess.run(('dd', 'if=/dev/zero', 'of=' + path, 'bs=1', 'seek=300M', 'count=1'), stdout=sys.stderr, stderr=sys.stderr, check=True)
+    subprocess.run(('/usr/sbin/mkfs.ext3', '-L', label, path), stdout=sys.stderr, stderr=sys.stderr, check=True)
+
+def check_disk_dump(path):
+    os.mkdir('mount')
+    subprocess.run(('mount', '-o', 'loop', path, 'mount'), stdout=sys.stderr, stderr=sys.stderr, check=True)
+    ret = dump_ok('mount/var/crash')
+    subprocess.run(('umount', 'mount'), stdout=sys.stderr, stderr=sys.stderr, check=True)
+    return ret
+
+def print_results(results, keys, flavour):
+    for key in keys:
+        # some values are only measured if the dump needs them
+        if key not in results:
+            continue
+        if flavour:
+           print('{}_{}={:d}'.format(key, flavour, results[key]))
+        else:
+           print('{}={:d}'.format(key, results[key]))
+
+# vim: set et ts=4 sw=4 :
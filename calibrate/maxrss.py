@@ -8,11 +8,15 @@ parser.add_argument('-d', '--debug', action='store_true',
                     help='print debugging messages on stderr')
 cmdline = parser.parse_args()
 
-contexts = dict()
-running = dict()
-rss = 0
-maxrss = 0
-maxrunning = dict()
+maxrss = None
+maxrunning = []
+checkpoint = None
+overruns = 0
+samples = {
+    'memfirst': dict(),
+    'memlow': dict(),
+    'memmax': dict(),
+}
 
 memfree = None
 cached = None
@@ -24,32 +28,28 @@ try:
     while True:
         (category, data) = input().split(':', 1)
 
-        if category == 'trace':
-            index = data.rindex(': rss_stat: ')
-            (context, cpu, stamp) = data[:index].rsplit(maxsplit=2)
-            mm = None
-            size = None
-            curr = False
-            for field in data[index+12:].split():
-                (key, val) = field.split('=')
-                if key == 'mm_id':
-                    mm = int(val)
-                elif key == 'curr':
-                    if int(val):
-                        curr = True
-                elif key == 'size':
-                    size = int(val[:-1]) // 1024
-            if curr:
-                contexts[mm] = context.strip()
-            oldsize = running.get(mm, 0)
-            if size:
-                running[mm] = size
-            else:
-                del running[mm]
-            rss += size - oldsize
-            if rss > maxrss:
-                maxrss = rss
-                maxrunning = running.copy()
+        if category == 'rss':
+            (key, value) = data.split('=', 1)
+            if key == 'peak':
+                maxrss = int(value.split()[0])
+            elif key == 'mm':
+                (mm, pid, comm, size) = value.split()
+                maxrunning.append((int(mm), int(pid), comm, int(size)))
+
+        elif category == 'checkpoint':
+            (stamp, current, peak, count) = data.split()
+            checkpoint = int(peak)
+
+        elif category in samples:
+            (key, value) = data.split('=', 1)
+            samples[category][key] = int(value)
+
+        elif category == 'overrun':
+            (cpu, counts) = data.split('=', 1)
+            lost = int(counts.split()[0])
+            overruns += lost
+            print('WARNING: {} rss_stat events lost on {}'.format(lost, cpu),
+                  file=sys.stderr)
 
         elif category == 'meminfo':
             (key, value) = data.split(':')
@@ -78,6 +78,18 @@ try:
 except EOFError:
     pass
 
+if maxrss is None:
+    if checkpoint is None:
+        print('Cannot determine maximum RSS', file=sys.stderr)
+        exit(1)
+    print('WARNING: no trackrss summary, using the last checkpoint',
+          file=sys.stderr)
+    maxrss = checkpoint
+
+if overruns:
+    print('WARNING: trace buffer overruns, USER_BASE may be too low',
+          file=sys.stderr)
+
 if memfree is None:
     print('Cannot determine MemFree', file=sys.stderr)
     exit(1)
@@ -99,8 +111,11 @@ if sizeofpage is None:
 
 if cmdline.debug:
     print('Max RSS processes:', file=sys.stderr)
-    for (mm, rss) in maxrunning.items():
-        desc = contexts.get(mm, 'mm_{}'.format(mm))
+    for (mm, pid, comm, rss) in maxrunning:
+        if pid:
+            desc = 'pid {} ({})'.format(pid, comm)
+        else:
+            desc = 'mm_{}'.format(mm)
         print('-', desc, rss, file=sys.stderr)
 
 print('PAGESIZE={:d}'.format(pagesize))
@@ -109,3 +124,21 @@ print('INIT_MEMFREE={:d}'.format(memfree))
 print('INIT_CACHED={:d}'.format(cached))
 print('PERCPU={:d}'.format(percpu))
 print('USER_BASE={:d}'.format(maxrss))
+
+# Kernel memory at the MemFree low-water mark during the dump
+low = samples['memlow']
+if 'MemFree' in low:
+    first = samples['memfirst']
+    print('LOW_MEMFREE={:d}'.format(low['MemFree']))
+    print('LOW_CACHED={:d}'.format(low.get('Cached', 0)))
+    print('LOW_BUFFERS={:d}'.format(low.get('Buffers', 0)))
+    print('LOW_ANON={:d}'.format(low.get('AnonPages', 0)))
+    print('LOW_DIRTY={:d}'.format(low.get('Dirty', 0) +
+                                  low.get('Writeback', 0)))
+    print('LOW_SUNRECLAIM_GROWTH={:d}'.format(
+        max(0, low.get('SUnreclaim', 0) - first.get('SUnreclaim', 0))))
+    proc = ('KernelStack', 'PageTables')
+    print('LOW_PROC_GROWTH={:d}'.format(
+        max(0, sum(low.get(k, 0) - first.get(k, 0) for k in proc))))
+elif cmdline.debug:
+    print('No kernel memory samples', file=sys.stderr)
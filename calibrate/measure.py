@@ -0,0 +1,163 @@
+#! /usr/bin/python3
+
+#
+# Measure the memory requirements of the kdump environment of this host.
+#
+# A kdump initrd is built with the host's kdump configuration and booted
+# in QEMU with the installed kdump kernel. The dump is saved to a local
+# disk image, and the resulting calibration constants are printed in the
+# same format as calibrate.conf.
+#
+
+import sys
+import os
+import shlex
+import shutil
+import subprocess
+import tempfile
+
+from calibvm import build_elfcorehdr, build_initrd, check_disk_dump, \
+    elfcorehdr_address, kernel_version, make_disk, print_results, \
+    qemu_name, run_qemu
+
+KDUMP_KERNEL = '/var/lib/kdump/kernel'
+KDUMP_KERNEL_VERSION = '/var/lib/kdump/kernel-version'
+
+params = dict()
+
+# Host options that the VM cannot reproduce: they need host storage, or
+# run makedumpfile without MAKEDUMPFILE_OPTIONS, which would then read
+# the synthetic /proc/vmcore
+OVERRIDES = (
+    ('KDUMP_SAVEDIR', '/var/crash'),
+    ('KDUMP_FREE_DISK_SIZE', '0'),
+    ('KDUMP_KEEP_OLD_DUMPS', '0'),
+    ('KDUMP_PRESCRIPT', ''),
+    ('KDUMP_POSTSCRIPT', ''),
+    ('KDUMP_TRANSFER', ''),
+    ('KDUMP_IMMEDIATE_REBOOT', 'true'),
+    ('KDUMP_TRIAGE', 'no'),
+    ('KDUMP_DEADLINE', '0'),
+    ('KDUMP_SPLIT_DIRS', ''),
+    ('KDUMP_STAGING_DIR', ''),
+)
+
+def host_options(source, names):
+    script = '[ -f "$1" ] && . "$1"; shift; for n; do echo "${!n}"; done'
+    args = ('bash', '-c', script, 'bash', source, *names)
+    out = subprocess.run(args, stdout=subprocess.PIPE, check=True,
+                         universal_newlines=True).stdout
+    return dict(zip(names, out.splitlines()))
+
+def check_config(source):
+    # These formats are saved by kdump-rawdump or kdump-elfdump, which
+    # read /proc/vmcore directly, so the dump cannot be redirected
+    opts = host_options(source, ('KDUMP_DUMPFORMAT', 'KDUMP_DUMPLEVEL'))
+    dumpformat = opts['KDUMP_DUMPFORMAT']
+    level = opts['KDUMP_DUMPLEVEL']
+    level = int(level) if level.isdigit() else 31
+    if dumpformat in ('raw', 'raw-zstd') or \
+       (dumpformat == 'ELF' and level & ~1 == 0):
+        print('KDUMP_DUMPFORMAT={} with KDUMP_DUMPLEVEL={} cannot be '
+              'measured in a VM'.format(dumpformat, level), file=sys.stderr)
+        exit(1)
+
+def write_config(path):
+    # Start with the host configuration and redirect the dump to the
+    # local disk image. The dump itself reads /proc/kcore, because the
+    # synthetic ELF core headers do not describe any real memory.
+    source = os.environ.get('KDUMP_CONF', '/etc/sysconfig/kdump')
+    options = os.environ.get('MAKEDUMPFILE_OPTIONS', '')
+    check_config(source)
+    with open(path, 'w') as f:
+        f.write('[ -f {0} ] && . {0}\n'.format(shlex.quote(source)))
+        for (name, value) in OVERRIDES:
+            f.write('{}={}\n'.format(name, shlex.quote(value)))
+        f.write('MAKEDUMPFILE_OPTIONS={}\n'.format(
+            shlex.quote(options + ' /proc/kcore > /tmp/fifo #')))
+
+def measure():
+    params['KERNEL'] = os.path.realpath(KDUMP_KERNEL)
+    if not os.path.isfile(params['KERNEL']):
+        print('No kdump kernel found in ' + KDUMP_KERNEL, file=sys.stderr)
+        exit(1)
+
+    try:
+        with open(KDUMP_KERNEL_VERSION) as f:
+            params['KERNELVER'] = f.read().strip()
+    except OSError:
+        params['KERNELVER'] = kernel_version(params['KERNEL'])
+
+    flavour = params['KERNELVER'].split('-')[-1]
+    if flavour == 'default':
+        flavour = None
+
+    with tempfile.TemporaryDirectory() as tmpdir:
+        oldcwd = os.getcwd()
+        os.chdir(tmpdir)
+        elfcorehdr = build_elfcorehdr(params['SCRIPTDIR'],
+                                      elfcorehdr_address(params['ARCH']))
+        make_disk('disk.raw')
+
+        config = os.path.abspath('measure.conf')
+        write_config(config)
+        initrd = build_initrd(params['SCRIPTDIR'], params, config,
+                              'measure-initrd')
+        results = run_qemu(params['SCRIPTDIR'], params, initrd, elfcorehdr)
+        if not check_disk_dump('disk.raw'):
+            print('Dump in the VM failed; measurement failed', file=sys.stderr)
+            exit(1)
+
+        os.chdir(oldcwd)
+
+    keys = (
+        'KERNEL_BASE',
+        'KERNEL_INIT',
+        'INIT_CACHED',
+        'PAGESIZE',
+        'SIZEOFPAGE',
+        'PERCPU',
+        'USER_BASE',
+        'BUF_PER_DIRTY_MB',
+    )
+    print_results(results, keys, flavour)
+
+################################################
+# main program
+
+# Directory with scripts and the trackrss and mkelfcorehdr binaries
+params['SCRIPTDIR'] = os.path.abspath(os.path.dirname(sys.argv[0]))
+
+# Use the installed dracut and kdump dracut module
+params['LOCAL_DRACUT'] = False
+
+# Total VM memory in KiB:
+params['TOTAL_RAM'] = 1024 * 1024
+
+# Number of CPUs for the VM
+params['NUMCPUS'] = 2
+
+# Where kernel messages should go
+params['MESSAGES_LOG'] = 'messages.log'
+
+# Where trackrss log should go
+params['TRACKRSS_LOG'] = 'trackrss.log'
+params['TRACKRSS_PORT_LOG'] = 'trackrss-port.log'
+
+params['ARCH'] = os.uname()[4]
+
+# Network targets are not measured; a local disk is used instead
+params['NET'] = False
+
+if os.environ.get('KDUMP_FADUMP') == 'true':
+    print('Measuring is not supported with fadump', file=sys.stderr)
+    exit(1)
+
+if not shutil.which(qemu_name(params['ARCH'])):
+    print(qemu_name(params['ARCH']) + ' is needed to measure kdump',
+          file=sys.stderr)
+    exit(1)
+
+measure()
+
+# vim: set et ts=4 sw=4 :
@@ -15,8 +15,17 @@
  * along with this program; if not, see <https://www.gnu.org/licenses>.
  */
 
+/*
+ * Write ELF core headers for the calibration VM, optionally describing a
+ * large crashed system. Only the capture kernel uses the layout, for the
+ * /proc/vmcore setup and the note merging. The memory is not backed by
+ * real data, and the VMCOREINFO note has no symbols, so makedumpfile
+ * cannot read the resulting /proc/vmcore.
+ */
+
 #include <elf.h>
 #include <endian.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -74,7 +83,26 @@ struct vmcoreinfo_note {
 	elf_aligned char align[];
 } __attribute__((packed));
 
-static int write_elfcorehdr(FILE *f, unsigned long long addr)
+/* Layout of the described crashed system */
+struct core_layout {
+	unsigned long cpus;		/* number of PRSTATUS notes */
+	unsigned long long memory;	/* total size of the PT_LOADs */
+	unsigned long ranges;		/* number of memory PT_LOADs */
+	unsigned long long start;	/* physical address of the first one */
+	unsigned long long backing;	/* shared backing address, or 0 */
+};
+
+static int write_phdr(FILE *f, const Elf64_Phdr *phdr, const char *what)
+{
+	if (fwrite(phdr, sizeof(*phdr), 1, f) != 1) {
+		perror(what);
+		return 1;
+	}
+	return 0;
+}
+
+static int write_elfcorehdr(FILE *f, unsigned long long addr,
+			    const struct core_layout *layout)
 {
 	static Elf64_Ehdr ehdr = {
 		.e_ident = {
@@ -87,11 +115,17 @@ static int write_elfcorehdr(FILE *f, unsigned long long addr)
 		.e_phoff = sizeof(Elf64_Ehdr),
 		.e_ehsize = sizeof(Elf64_Ehdr),
 		.e_phentsize = sizeof(Elf64_Phdr),
-		.e_phnum = 4,
 	};
+	unsigned long long paddr, size, rest;
+	unsigned long ranges;
 	Elf64_Phdr phdr;
+	unsigned long i;
 	size_t sz;
 
+	/* PRSTATUS per CPU, VMCOREINFO, kernel text, directmap ranges */
+	ranges = layout->memory ? layout->ranges : 1;
+	ehdr.e_phnum = layout->cpus + 2 + ranges;
+
 	if (fwrite(&ehdr, sizeof(ehdr), 1, f) != 1) {
 		perror("Ehdr");
 		return 1;
@@ -100,19 +134,19 @@ static int write_elfcorehdr(FILE *f, unsigned long long addr)
 	/* Address just after program headers */
 	addr += ehdr.e_phoff + ehdr.e_phnum * ehdr.e_phentsize;
 
-	/* PRSTATUS note */
+	/* PRSTATUS notes, one per CPU like the kernel does */
 	sz = sizeof(struct prstatus_note);
-	memset(&phdr, 0, sizeof(phdr));
-	phdr.p_type = PT_NOTE;
-	phdr.p_offset = addr;
-	phdr.p_paddr = addr;
-	phdr.p_filesz = sz;
-	phdr.p_memsz = sz;
-	if (fwrite(&phdr, sizeof(phdr), 1, f) != 1) {
-		perror("PRSTATUS");
-		return 1;
+	for (i = 0; i < layout->cpus; ++i) {
+		memset(&phdr, 0, sizeof(phdr));
+		phdr.p_type = PT_NOTE;
+		phdr.p_offset = addr;
+		phdr.p_paddr = addr;
+		phdr.p_filesz = sz;
+		phdr.p_memsz = sz;
+		if (write_phdr(f, &phdr, "PRSTATUS"))
+			return 1;
+		addr += phdr.p_filesz;
 	}
-	addr += phdr.p_filesz;
 
 	/* VMCOREINFO note */
 	sz = sizeof(struct vmcoreinfo_note);
@@ -122,28 +156,43 @@ static int write_elfcorehdr(FILE *f, unsigned long long addr)
 	phdr.p_paddr = addr;
 	phdr.p_filesz = sz;
 	phdr.p_memsz = sz;
-	if (fwrite(&phdr, sizeof(phdr), 1, f) != 1) {
-		perror("VMCOREINFO");
+	if (write_phdr(f, &phdr, "VMCOREINFO"))
 		return 1;
-	}
 	addr += phdr.p_filesz;
 
 	/* kernel text LOAD - not checked */
 	memset(&phdr, 0, sizeof(phdr));
 	phdr.p_type = PT_LOAD;
 	phdr.p_flags = PF_R | PF_W | PF_X;
-	if (fwrite(&phdr, sizeof(phdr), 1, f) != 1) {
-		perror("kernel text LOAD");
+	if (write_phdr(f, &phdr, "kernel text LOAD"))
 		return 1;
-	}
 
-	/* directmap LOAD - not checked */
-	memset(&phdr, 0, sizeof(phdr));
-	phdr.p_type = PT_LOAD;
-	phdr.p_flags = PF_R | PF_W | PF_X;
-	if (fwrite(&phdr, sizeof(phdr), 1, f) != 1) {
-		perror("directmap LOAD");
-		return 1;
+	/*
+	 * directmap LOADs - not read by the calibration, so they need not
+	 * be backed by real memory; they either describe memory that does
+	 * not exist in the VM (sparse), or all of them alias the same
+	 * backing memory (deduplicated)
+	 */
+	paddr = layout->start;
+	rest = layout->memory;
+	for (i = 0; i < ranges; ++i) {
+		size = rest / (ranges - i);
+		size &= ~0xfffULL;
+		if (i == ranges - 1)
+			size = rest;
+		memset(&phdr, 0, sizeof(phdr));
+		phdr.p_type = PT_LOAD;
+		phdr.p_flags = PF_R | PF_W | PF_X;
+		if (size) {
+			phdr.p_offset = layout->backing ? layout->backing : paddr;
+			phdr.p_paddr = paddr;
+			phdr.p_filesz = size;
+			phdr.p_memsz = size;
+		}
+		if (write_phdr(f, &phdr, "directmap LOAD"))
+			return 1;
+		paddr += size;
+		rest -= size;
 	}
 
 	/* PRSTATUS content - not checked */
@@ -153,9 +202,12 @@ static int write_elfcorehdr(FILE *f, unsigned long long addr)
 	prstatus_note.hdr.n_descsz = sizeof(prstatus_t);
 	prstatus_note.hdr.n_type = NT_PRSTATUS;
 	strcpy(prstatus_note.name, core_name);
-	if (fwrite(&prstatus_note, sizeof(prstatus_note), 1, f) != 1) {
-		perror("PRSTATUS note");
-		return 1;
+	for (i = 0; i < layout->cpus; ++i) {
+		prstatus_note.status.pr_pid = i;
+		if (fwrite(&prstatus_note, sizeof(prstatus_note), 1, f) != 1) {
+			perror("PRSTATUS note");
+			return 1;
+		}
 	}
 
 	/* VMCOREINFO content - not checked? */
@@ -173,32 +225,126 @@ static int write_elfcorehdr(FILE *f, unsigned long long addr)
 	return 0;
 }
 
-int main(int argc, char *argv[])
+/* Parse a size with an optional K, M, G or T suffix. */
+static int parse_size(const char *arg, unsigned long long *size)
 {
-	unsigned long long addr;
 	char *endptr;
+
+	*size = strtoull(arg, &endptr, 0);
+	switch (*endptr) {
+	case 'T': case 't':
+		*size <<= 10;
+		/* fall through */
+	case 'G': case 'g':
+		*size <<= 10;
+		/* fall through */
+	case 'M': case 'm':
+		*size <<= 10;
+		/* fall through */
+	case 'K': case 'k':
+		*size <<= 10;
+		++endptr;
+		break;
+	}
+	if (*endptr || endptr == arg) {
+		fprintf(stderr, "Invalid number: %s\n", arg);
+		return 1;
+	}
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options] <filename> <load_address>\n"
+		"\n"
+		"Options:\n"
+		"  -c, --cpus=N         number of CPU notes (default 1)\n"
+		"  -m, --memory=SIZE    total memory in PT_LOADs (default 0)\n"
+		"  -r, --ranges=N       number of memory PT_LOADs (default 1)\n"
+		"  -s, --start=ADDR     physical address of the memory (default 0)\n"
+		"  -b, --backing=ADDR   back all PT_LOADs by the same memory\n"
+		"\n"
+		"The layout loads the capture kernel only; makedumpfile cannot\n"
+		"read the memory it describes.\n",
+		name);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "cpus", 1, 0, 'c' },
+		{ "memory", 1, 0, 'm' },
+		{ "ranges", 1, 0, 'r' },
+		{ "start", 1, 0, 's' },
+		{ "backing", 1, 0, 'b' },
+		{ "help", 0, 0, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+	struct core_layout layout = {
+		.cpus = 1,
+		.ranges = 1,
+	};
+	unsigned long long addr, val;
+	int c;
 	FILE *f;
 	int ret;
 
-	if (argc != 3) {
-		fprintf(stderr, "Usage: %s <filename> <load_address>\n",
-			argv[0]);
+	while ((c = getopt_long(argc, argv, "c:m:r:s:b:h", opts, NULL)) != -1) {
+		switch (c) {
+		case 'm':
+			if (parse_size(optarg, &layout.memory))
+				return 1;
+			break;
+		case 'c':
+		case 'r':
+		case 's':
+		case 'b':
+			if (parse_size(optarg, &val))
+				return 1;
+			if (c == 'c')
+				layout.cpus = val;
+			else if (c == 'r')
+				layout.ranges = val;
+			else if (c == 's')
+				layout.start = val;
+			else
+				layout.backing = val;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (argc - optind != 2) {
+		usage(argv[0]);
 		return 1;
 	}
 
-	addr = strtoull(argv[2], &endptr, 0);
-	if (*endptr) {
-		fprintf(stderr, "Invalid number: %s\n", argv[2]);
+	if (parse_size(argv[optind + 1], &addr))
+		return 1;
+
+	if (!layout.cpus || !layout.ranges) {
+		fprintf(stderr, "At least one CPU and one range is needed\n");
+		return 1;
+	}
+	/* e_phnum must not need extended numbering */
+	if (layout.cpus + 2 + layout.ranges >= PN_XNUM) {
+		fprintf(stderr, "Too many program headers\n");
 		return 1;
 	}
 
-	f = fopen(argv[1], "w");
+	f = fopen(argv[optind], "w");
 	if (!f) {
 		perror("fopen");
 		return 1;
 	}
 
-	ret = write_elfcorehdr(f, addr);
+	ret = write_elfcorehdr(f, addr, &layout);
 
 	fclose(f);
 	return ret;
@@ -18,13 +18,18 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <elf.h>
+#include <endian.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mount.h>
@@ -40,9 +45,12 @@
 /* Default log device: ttyS1 */
 #define LOG_DEV		makedev(4, 65)
 
-/* Delay after each line [us] */
+/* Delay after each line on a serial port [us] */
 #define LOG_DELAY_US	100
 
+/* Virtio serial ports, looked up by name */
+#define VIRTIO_PORTS_DIR	"/sys/class/virtio-ports"
+
 /* Random number generator device */
 #define RANDOM_DEV	makedev(1, 8)
 #define RANDOM_PATH	"/dev/random"
@@ -62,54 +70,960 @@
 
 #define MAX_MEMINFO_LINES	100
 
-#define TRACE_LINE_LENGTH	256
+/* Per-CPU ring buffer size */
+#define TRACE_BUFFER_KB		"4096"
+
+/* Maximum number of CPUs to trace */
+#define MAX_CPUS		256
+
+/* How often the output thread looks for new events [ms] */
+#define OUTPUT_INTERVAL_MS	100
+
+/* How long an event may stay in an idle CPU's buffer until read [ms] */
+#define EVENT_LAG_MS		500
+
+/* Default interval between kernel memory samples [ms] */
+#define SAMPLE_INTERVAL_MS	50
+
+/* Initial number of slots in the mm table (must be a power of two) */
+#define MM_TABLE_INIT		256
 
 #define KALLSYMS	"/proc/kallsyms"
 #define KCORE		"/proc/kcore"
 
-struct connection {
-	FILE *f;
+/* Ring buffer event types, see include/linux/ring_buffer.h */
+#define RINGBUF_TYPE_DATA_TYPE_LEN_MAX	28
+#define RINGBUF_TYPE_PADDING		29
+#define RINGBUF_TYPE_TIME_EXTEND	30
+#define RINGBUF_TYPE_TIME_STAMP		31
+
+/* Flags in the commit field of a ring buffer page */
+#define RB_MISSED_EVENTS	(1UL << 31)
+#define RB_MISSED_STORED	(1UL << 30)
+#define RB_COMMIT_MASK		(RB_MISSED_STORED - 1)
+
+/* Location of a field in a binary trace record */
+struct field {
+	unsigned offset;
+	unsigned size;
+};
+
+/* Layout of ring buffer pages and of the rss_stat event */
+static struct {
+	struct field commit;
+	struct field data;
+
+	unsigned id;
+	struct field common_type;
+	struct field common_pid;
+	struct field mm_id;
+	struct field curr;
+	struct field size;
+} layout;
+
+struct rss_event {
+	uint64_t ts;
+	unsigned cpu;
+	int pid;
+	unsigned mm_id;
+	int curr;
+	long size;
 };
 
-static int conn_init(struct connection *conn)
+/* Events passed from the per-CPU readers to the output thread */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct rss_event *ev;
+	size_t num, alloc;
+} queue = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+struct cpu_reader {
+	pthread_t thread;
+	unsigned cpu;
+	int fd;
+	unsigned long missed_pages;
+	unsigned long missed_events;
+	uint64_t last_ts;		/* latest queued event */
+	uint64_t read_since;		/* blocked in read() since [ns] */
+	int done;			/* no more events */
+};
+
+static struct cpu_reader readers[MAX_CPUS];
+static unsigned num_readers;
+
+/* Event timestamps are CLOCK_MONOTONIC */
+static int mono_trace_clock;
+
+static volatile sig_atomic_t terminate;
+
+/* Output throttling; not needed with a virtio port */
+static unsigned log_delay_us = LOG_DELAY_US;
+
+/* Interval between checkpoints [ms], or zero to print only the summary */
+static unsigned checkpoint_ms;
+
+/* Interval between kernel memory samples [ms], or zero to disable */
+static unsigned sample_ms = SAMPLE_INTERVAL_MS;
+
+/*
+ * Parse a "field:... name; offset:N; size:N;" line of a tracefs format file.
+ * Returns non-zero if the field name matches.
+ */
+static int parse_field(const char *line, const char *name, struct field *field)
+{
+	const char *p, *end;
+	size_t namelen = strlen(name);
+
+	p = strstr(line, "field:");
+	if (!p)
+		return 0;
+	end = strchr(p, ';');
+	if (!end || (size_t)(end - p) < namelen)
+		return 0;
+	/* the name is the last word before the semicolon (maybe an array) */
+	p = end;
+	while (p > line && p[-1] != ' ' && p[-1] != '*')
+		--p;
+	if ((size_t)(end - p) < namelen || strncmp(p, name, namelen) ||
+	    (p[namelen] != ';' && p[namelen] != '['))
+		return 0;
+
+	p = strstr(end, "offset:");
+	if (!p || sscanf(p, "offset:%u", &field->offset) != 1)
+		return 0;
+	p = strstr(p, "size:");
+	if (!p || sscanf(p, "size:%u", &field->size) != 1)
+		return 0;
+	return 1;
+}
+
+static int read_format(void)
 {
 	char path[PATH_MAX];
+	char line[256];
+	FILE *f;
+	int found = 0;
 
-	memset(conn, 0, sizeof(*conn));
+	snprintf(path, PATH_MAX, "%s/%s", TRACEFS_DIR, "events/header_page");
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return 1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (parse_field(line, "commit", &layout.commit))
+			found |= 1;
+		else if (parse_field(line, "data", &layout.data))
+			found |= 2;
+	}
+	fclose(f);
+	if (found != 3) {
+		fprintf(stderr, "Cannot parse %s\n", path);
+		return 1;
+	}
 
-	snprintf(path, PATH_MAX, "%s/%s", TRACEFS_DIR, "trace_pipe");
-	conn->f = fopen(path, "r");
-	if (!conn->f) {
+	found = 0;
+	snprintf(path, PATH_MAX, "%s/%s", TRACEFS_DIR,
+		 "events/kmem/rss_stat/format");
+	f = fopen(path, "r");
+	if (!f) {
 		perror(path);
 		return 1;
 	}
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "ID: %u", &layout.id) == 1)
+			found |= 1;
+		else if (parse_field(line, "common_type", &layout.common_type))
+			found |= 2;
+		else if (parse_field(line, "common_pid", &layout.common_pid))
+			found |= 4;
+		else if (parse_field(line, "mm_id", &layout.mm_id))
+			found |= 8;
+		else if (parse_field(line, "curr", &layout.curr))
+			found |= 16;
+		else if (parse_field(line, "size", &layout.size))
+			found |= 32;
+	}
+	fclose(f);
+	if (found != 63) {
+		fprintf(stderr, "Cannot parse %s\n", path);
+		return 1;
+	}
 
 	return 0;
 }
 
-static void conn_cleanup(struct connection *conn)
+/* Read an integer field of native byte order and size. */
+static long long get_field(const unsigned char *data, const struct field *field)
+{
+	switch (field->size) {
+	case 1: return *(int8_t *)(data + field->offset);
+	case 2: { int16_t v; memcpy(&v, data + field->offset, 2); return v; }
+	case 4: { int32_t v; memcpy(&v, data + field->offset, 4); return v; }
+	case 8: { int64_t v; memcpy(&v, data + field->offset, 8); return v; }
+	}
+	return 0;
+}
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void queue_events(struct cpu_reader *reader, struct rss_event *ev,
+			 size_t num)
+{
+	pthread_mutex_lock(&queue.lock);
+	/* a page holds the events of one CPU in order */
+	reader->last_ts = ev[num - 1].ts;
+	if (queue.num + num > queue.alloc) {
+		size_t alloc = queue.alloc ? queue.alloc : 1024;
+		struct rss_event *newev;
+
+		while (alloc < queue.num + num)
+			alloc *= 2;
+		newev = realloc(queue.ev, alloc * sizeof(*newev));
+		if (!newev) {
+			perror("Allocate event queue");
+			pthread_mutex_unlock(&queue.lock);
+			return;
+		}
+		queue.ev = newev;
+		queue.alloc = alloc;
+	}
+	memcpy(queue.ev + queue.num, ev, num * sizeof(*ev));
+	queue.num += num;
+	pthread_cond_signal(&queue.cond);
+	pthread_mutex_unlock(&queue.lock);
+}
+
+/*
+ * Decode one ring buffer page. Returns the number of rss_stat events
+ * stored in @ev, which must be big enough for a full page.
+ */
+static size_t decode_page(struct cpu_reader *reader, const unsigned char *page,
+			  size_t len, struct rss_event *ev)
 {
-	if (conn->f)
-		fclose(conn->f);
+	const unsigned char *p, *end;
+	unsigned long commit;
+	uint64_t ts;
+	size_t num = 0;
+
+	if (len < layout.data.offset)
+		return 0;
+
+	memcpy(&ts, page, sizeof(ts));
+	commit = get_field(page, &layout.commit);
+	p = page + layout.data.offset;
+	end = p + (commit & RB_COMMIT_MASK);
+	if (end > page + len)
+		end = page + len;
+
+	if (commit & RB_MISSED_EVENTS) {
+		++reader->missed_pages;
+		if ((commit & RB_MISSED_STORED) &&
+		    end + layout.commit.size <= page + len) {
+			struct field missed = {
+				end - page, layout.commit.size
+			};
+			reader->missed_events += get_field(page, &missed);
+		}
+	}
+
+	while (p + sizeof(uint32_t) <= end) {
+		const unsigned char *data;
+		unsigned type_len, time_delta;
+		uint32_t hdr, array0 = 0;
+		size_t datalen;
+
+		memcpy(&hdr, p, sizeof(hdr));
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+		type_len = hdr & 0x1f;
+		time_delta = hdr >> 5;
+#else
+		type_len = hdr >> 27;
+		time_delta = hdr & ((1U << 27) - 1);
+#endif
+		if (p + 2 * sizeof(uint32_t) <= end)
+			memcpy(&array0, p + sizeof(uint32_t), sizeof(array0));
+
+		switch (type_len) {
+		case RINGBUF_TYPE_PADDING:
+			if (!time_delta)
+				return num;
+			p += sizeof(uint32_t) + array0;
+			continue;
+
+		case RINGBUF_TYPE_TIME_EXTEND:
+			ts += ((uint64_t)array0 << 27) + time_delta;
+			p += 2 * sizeof(uint32_t);
+			continue;
+
+		case RINGBUF_TYPE_TIME_STAMP:
+			ts = ((uint64_t)array0 << 27) + time_delta;
+			p += 2 * sizeof(uint32_t);
+			continue;
+
+		case 0:
+			data = p + 2 * sizeof(uint32_t);
+			datalen = array0 - sizeof(uint32_t);
+			p += sizeof(uint32_t) + array0;
+			break;
+
+		default:
+			data = p + sizeof(uint32_t);
+			datalen = type_len * sizeof(uint32_t);
+			p += sizeof(uint32_t) + datalen;
+			break;
+		}
+
+		ts += time_delta;
+		if (p > end ||
+		    datalen < layout.size.offset + layout.size.size ||
+		    get_field(data, &layout.common_type) != layout.id)
+			continue;
+
+		ev[num].ts = ts;
+		ev[num].cpu = reader->cpu;
+		ev[num].pid = get_field(data, &layout.common_pid);
+		ev[num].mm_id = get_field(data, &layout.mm_id);
+		ev[num].curr = get_field(data, &layout.curr);
+		ev[num].size = get_field(data, &layout.size);
+		++num;
+	}
+
+	return num;
 }
 
-static int get_trace(struct connection *conn)
+/* The reader does not hold back any events of its CPU any more. */
+static void reader_done(struct cpu_reader *reader)
 {
-	char line[TRACE_LINE_LENGTH];
+	pthread_mutex_lock(&queue.lock);
+	reader->done = 1;
+	pthread_mutex_unlock(&queue.lock);
+}
 
-	while (fgets(line, sizeof(line), conn->f)) {
-		usleep(LOG_DELAY_US);
-		printf("trace:%s", line);
+static void *reader_thread(void *arg)
+{
+	struct cpu_reader *reader = arg;
+	long pagesize = sysconf(_SC_PAGESIZE);
+	unsigned char *page;
+	struct rss_event *ev;
+	ssize_t len;
+
+	page = malloc(pagesize);
+	/* an event takes at least 8 bytes */
+	ev = malloc(pagesize / 8 * sizeof(*ev));
+	if (!page || !ev) {
+		perror("Allocate trace page");
+		reader_done(reader);
+		return NULL;
 	}
 
-	if (errno) {
-		perror("Read from trace pipe");
+	for (;;) {
+		size_t num;
+
+		__atomic_store_n(&reader->read_since, monotonic_ns(),
+				 __ATOMIC_RELAXED);
+		len = read(reader->fd, page, pagesize);
+		__atomic_store_n(&reader->read_since, 0, __ATOMIC_RELAXED);
+		if (!len)
+			break;
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Read from trace_pipe_raw");
+			break;
+		}
+		num = decode_page(reader, page, len, ev);
+		if (num)
+			queue_events(reader, ev, num);
+	}
+
+	reader_done(reader);
+	free(ev);
+	free(page);
+	return NULL;
+}
+
+static int start_readers(void)
+{
+	char path[PATH_MAX];
+	unsigned cpu;
+
+	for (cpu = 0; cpu < MAX_CPUS; ++cpu) {
+		struct cpu_reader *reader = &readers[num_readers];
+
+		snprintf(path, PATH_MAX, "%s/per_cpu/cpu%u/trace_pipe_raw",
+			 TRACEFS_DIR, cpu);
+		reader->fd = open(path, O_RDONLY);
+		if (reader->fd < 0) {
+			if (errno == ENOENT)
+				continue;
+			perror(path);
+			return 1;
+		}
+		reader->cpu = cpu;
+		if (pthread_create(&reader->thread, NULL,
+				   reader_thread, reader)) {
+			perror("Create reader thread");
+			return 1;
+		}
+		++num_readers;
+	}
+
+	if (!num_readers) {
+		fprintf(stderr, "No per-CPU trace buffers found\n");
 		return 1;
 	}
+	return 0;
+}
+
+/* Kernel memory counters recorded by the sampler */
+static const char *const sample_fields[] = {
+	"MemFree",
+	"Buffers",
+	"Cached",
+	"AnonPages",
+	"Shmem",
+	"Slab",
+	"SReclaimable",
+	"SUnreclaim",
+	"KernelStack",
+	"PageTables",
+	"Percpu",
+	"VmallocUsed",
+	"Dirty",
+	"Writeback",
+};
+#define NUM_SAMPLE_FIELDS	(sizeof(sample_fields) / sizeof(sample_fields[0]))
+#define SAMPLE_MEMFREE		0
+
+/* Values in a sample are in KiB, -1 if not present */
+struct mem_sample {
+	long val[NUM_SAMPLE_FIELDS];
+};
 
+static struct {
+	pthread_mutex_t lock;
+	pthread_t thread;
+	unsigned long count;
+	struct mem_sample first;	/* when sampling started */
+	struct mem_sample low;		/* at the MemFree low-water mark */
+	struct mem_sample max;		/* maximum of each field */
+} sampler = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int read_sample(int fd, struct mem_sample *sample)
+{
+	char buf[4096];
+	char *line, *next;
+	ssize_t len;
+	unsigned i;
+
+	len = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0)
+		return 1;
+	buf[len] = 0;
+
+	for (i = 0; i < NUM_SAMPLE_FIELDS; ++i)
+		sample->val[i] = -1;
+
+	for (line = buf; *line; line = next) {
+		char *colon;
+
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = 0;
+		else
+			next = line + strlen(line);
+
+		colon = strchr(line, ':');
+		if (!colon)
+			continue;
+		*colon = 0;
+		for (i = 0; i < NUM_SAMPLE_FIELDS; ++i)
+			if (!strcmp(line, sample_fields[i])) {
+				sample->val[i] = strtol(colon + 1, NULL, 10);
+				break;
+			}
+	}
 	return 0;
 }
 
+static void record_sample(const struct mem_sample *sample)
+{
+	unsigned i;
+
+	pthread_mutex_lock(&sampler.lock);
+	if (!sampler.count++) {
+		sampler.first = *sample;
+		sampler.low = *sample;
+		sampler.max = *sample;
+	} else {
+		if (sample->val[SAMPLE_MEMFREE] < sampler.low.val[SAMPLE_MEMFREE])
+			sampler.low = *sample;
+		for (i = 0; i < NUM_SAMPLE_FIELDS; ++i)
+			if (sample->val[i] > sampler.max.val[i])
+				sampler.max.val[i] = sample->val[i];
+	}
+	pthread_mutex_unlock(&sampler.lock);
+}
+
+/*
+ * Sample kernel memory usage while kdump runs. Only the user-space
+ * RSS is traced, so this is the only way to see the kernel grow, e.g.
+ * with slab and page cache used by the dump I/O.
+ */
+static void *sampler_thread(void *arg)
+{
+	struct timespec interval;
+	struct mem_sample sample;
+	int fd;
+
+	fd = open(PROCFS_MEMINFO, O_RDONLY);
+	if (fd < 0) {
+		perror(PROCFS_MEMINFO);
+		return NULL;
+	}
+
+	interval.tv_sec = sample_ms / 1000;
+	interval.tv_nsec = (sample_ms % 1000) * 1000000L;
+	for (;;) {
+		if (read_sample(fd, &sample) == 0)
+			record_sample(&sample);
+		nanosleep(&interval, NULL);
+	}
+	return NULL;
+}
+
+static int start_sampler(void)
+{
+	if (!sample_ms)
+		return 0;
+	if (pthread_create(&sampler.thread, NULL, sampler_thread, NULL)) {
+		perror("Create sampler thread");
+		return 1;
+	}
+	return 0;
+}
+
+static void print_sample(const char *category, const struct mem_sample *sample)
+{
+	unsigned i;
+
+	for (i = 0; i < NUM_SAMPLE_FIELDS; ++i)
+		if (sample->val[i] >= 0)
+			printf("%s:%s=%ld\n", category, sample_fields[i],
+			       sample->val[i]);
+}
+
+/* Print the samples at start, at the MemFree low-water mark and maximum. */
+static void print_samples(void)
+{
+	pthread_mutex_lock(&sampler.lock);
+	if (sampler.count) {
+		printf("memsample:count=%lu\n", sampler.count);
+		print_sample("memfirst", &sampler.first);
+		print_sample("memlow", &sampler.low);
+		print_sample("memmax", &sampler.max);
+	}
+	pthread_mutex_unlock(&sampler.lock);
+}
+
+/* Report events lost because a ring buffer overflowed. */
+static void print_overruns(void)
+{
+	char path[PATH_MAX];
+	char line[256];
+	unsigned i;
+
+	for (i = 0; i < num_readers; ++i) {
+		struct cpu_reader *reader = &readers[i];
+		unsigned long overrun = 0;
+		FILE *f;
+
+		snprintf(path, PATH_MAX, "%s/per_cpu/cpu%u/stats",
+			 TRACEFS_DIR, reader->cpu);
+		f = fopen(path, "r");
+		if (f) {
+			while (fgets(line, sizeof(line), f))
+				if (sscanf(line, "overrun: %lu", &overrun) == 1)
+					break;
+			fclose(f);
+		}
+		if (overrun < reader->missed_events)
+			overrun = reader->missed_events;
+		if (overrun || reader->missed_pages)
+			printf("overrun:cpu%u=%lu pages=%lu\n", reader->cpu,
+			       overrun, reader->missed_pages);
+	}
+}
+
+/* Per-mm RSS, keyed by mm_id */
+struct mm_entry {
+	unsigned mm_id;
+	int pid;		/* owner, or 0 if not known yet */
+	long size;		/* 0 marks an empty slot */
+	char comm[16];
+};
+
+/* Open-addressed hash table with linear probing */
+static struct {
+	struct mm_entry *slots;
+	size_t mask;
+	size_t used;
+} mm_table;
+
+/* Aggregated RSS of all mms */
+static struct {
+	unsigned long long events;
+	uint64_t last_ts;
+	long total;
+	long peak;
+	uint64_t peak_ts;
+	struct mm_entry *snap;	/* mms contributing to the peak */
+	size_t snap_num, snap_alloc;
+} rss;
+
+static size_t mm_hash(unsigned mm_id)
+{
+	return (mm_id * 2654435761U) & mm_table.mask;
+}
+
+static int mm_table_grow(void)
+{
+	size_t oldsize = mm_table.slots ? mm_table.mask + 1 : 0;
+	size_t newsize = oldsize ? oldsize * 2 : MM_TABLE_INIT;
+	struct mm_entry *old = mm_table.slots;
+	size_t i;
+
+	mm_table.slots = calloc(newsize, sizeof(*mm_table.slots));
+	if (!mm_table.slots) {
+		mm_table.slots = old;
+		return 1;
+	}
+	mm_table.mask = newsize - 1;
+	for (i = 0; i < oldsize; ++i) {
+		size_t pos;
+
+		if (!old[i].size)
+			continue;
+		pos = mm_hash(old[i].mm_id);
+		while (mm_table.slots[pos].size)
+			pos = (pos + 1) & mm_table.mask;
+		mm_table.slots[pos] = old[i];
+	}
+	free(old);
+	return 0;
+}
+
+/*
+ * Find the slot of an mm. If the mm is not in the table, return the
+ * empty slot where it belongs, or NULL if the table cannot grow.
+ */
+static struct mm_entry *mm_lookup(unsigned mm_id)
+{
+	size_t pos;
+
+	if (mm_table.used * 4 >= mm_table.mask * 3 && mm_table_grow())
+		return NULL;
+
+	pos = mm_hash(mm_id);
+	while (mm_table.slots[pos].size && mm_table.slots[pos].mm_id != mm_id)
+		pos = (pos + 1) & mm_table.mask;
+	return &mm_table.slots[pos];
+}
+
+/*
+ * Remove an entry and shift back any following entries that would
+ * otherwise become unreachable, so no tombstones are needed.
+ */
+static void mm_remove(struct mm_entry *entry)
+{
+	size_t hole = entry - mm_table.slots;
+	size_t pos = hole;
+
+	for (;;) {
+		size_t home;
+
+		pos = (pos + 1) & mm_table.mask;
+		if (!mm_table.slots[pos].size)
+			break;
+		home = mm_hash(mm_table.slots[pos].mm_id);
+		/* can the entry at pos move to the hole? */
+		if (((pos - home) & mm_table.mask) >=
+		    ((pos - hole) & mm_table.mask)) {
+			mm_table.slots[hole] = mm_table.slots[pos];
+			hole = pos;
+		}
+	}
+	mm_table.slots[hole].size = 0;
+	--mm_table.used;
+}
+
+static void read_comm(int pid, char *comm, size_t len)
+{
+	char path[64];
+	FILE *f;
+
+	comm[0] = 0;
+	snprintf(path, sizeof(path), "/proc/%d/comm", pid);
+	f = fopen(path, "r");
+	if (!f)
+		return;
+	if (fgets(comm, len, f))
+		comm[strcspn(comm, "\n")] = 0;
+	fclose(f);
+}
+
+/* Remember which mms make up the current peak. */
+static void take_snapshot(void)
+{
+	size_t i;
+
+	if (rss.snap_alloc < mm_table.used) {
+		size_t alloc = mm_table.mask + 1;
+		struct mm_entry *snap;
+
+		snap = realloc(rss.snap, alloc * sizeof(*snap));
+		if (!snap) {
+			rss.snap_num = 0;
+			return;
+		}
+		rss.snap = snap;
+		rss.snap_alloc = alloc;
+	}
+
+	rss.snap_num = 0;
+	for (i = 0; i <= mm_table.mask; ++i)
+		if (mm_table.slots[i].size)
+			rss.snap[rss.snap_num++] = mm_table.slots[i];
+}
+
+static void account_event(const struct rss_event *ev)
+{
+	struct mm_entry *entry;
+	long oldsize = 0;
+
+	++rss.events;
+	rss.last_ts = ev->ts;
+
+	entry = mm_lookup(ev->mm_id);
+	if (!entry)
+		return;
+
+	if (entry->size)
+		oldsize = entry->size;
+	if (!ev->size) {
+		if (oldsize)
+			mm_remove(entry);
+	} else {
+		if (!oldsize) {
+			entry->mm_id = ev->mm_id;
+			entry->pid = 0;
+			entry->comm[0] = 0;
+			++mm_table.used;
+		}
+		entry->size = ev->size;
+		if (ev->curr && entry->pid != ev->pid) {
+			entry->pid = ev->pid;
+			read_comm(ev->pid, entry->comm, sizeof(entry->comm));
+		}
+	}
+	rss.total += ev->size - oldsize;
+
+	if (rss.total > rss.peak) {
+		rss.peak = rss.total;
+		rss.peak_ts = ev->ts;
+		take_snapshot();
+	}
+}
+
+static int compare_events(const void *a, const void *b)
+{
+	const struct rss_event *ea = a, *eb = b;
+
+	return ea->ts < eb->ts ? -1 : ea->ts > eb->ts;
+}
+
+static void print_checkpoint(void)
+{
+	printf("checkpoint:%llu %ld %ld %llu\n",
+	       (unsigned long long)rss.last_ts, rss.total / 1024,
+	       rss.peak / 1024, rss.events);
+}
+
+/* Print the peak and the mms that contributed to it. */
+static void print_summary(void)
+{
+	size_t i;
+
+	printf("rss:events=%llu\n", rss.events);
+	printf("rss:peak=%ld %llu\n", rss.peak / 1024,
+	       (unsigned long long)rss.peak_ts);
+	for (i = 0; i < rss.snap_num; ++i) {
+		const struct mm_entry *entry = &rss.snap[i];
+
+		printf("rss:mm=%u %d %s %ld\n", entry->mm_id, entry->pid,
+		       entry->comm[0] ? entry->comm : "-",
+		       entry->size / 1024);
+	}
+}
+
+static long elapsed_ms(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000L +
+		(to->tv_nsec - from->tv_nsec) / 1000000L;
+}
+
+/*
+ * Return the timestamp up to which all CPUs have delivered their events.
+ * A reader that has been blocked in read() for EVENT_LAG_MS has an empty
+ * buffer (buffer_percent is 0), so its CPU holds back at most the events
+ * of the last EVENT_LAG_MS. Call with queue.lock held.
+ */
+static uint64_t event_watermark(void)
+{
+	uint64_t now = monotonic_ns(), lag = EVENT_LAG_MS * 1000000ULL;
+	uint64_t watermark = UINT64_MAX, limit, since;
+	unsigned i;
+
+	for (i = 0; i < num_readers; ++i) {
+		struct cpu_reader *reader = &readers[i];
+
+		if (reader->done)
+			continue;
+		limit = reader->last_ts;
+		since = __atomic_load_n(&reader->read_since, __ATOMIC_RELAXED);
+		if (since && now - since >= lag) {
+			if (!mono_trace_clock)
+				limit = UINT64_MAX;
+			else if (now - lag > limit)
+				limit = now - lag;
+		}
+		if (limit < watermark)
+			watermark = limit;
+	}
+	return watermark;
+}
+
+/* Account the held events up to @watermark, in timestamp order. */
+static void account_held(struct rss_event *held, size_t *num,
+			 uint64_t watermark)
+{
+	size_t i;
+
+	qsort(held, *num, sizeof(*held), compare_events);
+	for (i = 0; i < *num && held[i].ts <= watermark; ++i)
+		account_event(&held[i]);
+	memmove(held, held + i, (*num - i) * sizeof(*held));
+	*num -= i;
+}
+
+/*
+ * Aggregate the events from all CPUs. Only the summary is printed at
+ * the end, optionally preceded by periodic checkpoints, so the output
+ * stays small regardless of the number of events.
+ */
+static void process_events(void)
+{
+	struct rss_event *ev = NULL, *held = NULL;
+	size_t alloc = 0, num_held = 0, held_alloc = 0;
+	struct timespec deadline = { 0, 0 };
+	struct timespec last_checkpoint;
+
+	clock_gettime(CLOCK_MONOTONIC, &last_checkpoint);
+	for (;;) {
+		struct timespec now;
+		uint64_t watermark;
+		size_t num;
+
+		pthread_mutex_lock(&queue.lock);
+		if (!queue.num) {
+			clock_gettime(CLOCK_REALTIME, &now);
+			now.tv_nsec += OUTPUT_INTERVAL_MS * 1000000L;
+			if (now.tv_nsec >= 1000000000L) {
+				now.tv_nsec -= 1000000000L;
+				++now.tv_sec;
+			}
+			pthread_cond_timedwait(&queue.cond, &queue.lock, &now);
+		}
+		/* swap the buffers so the readers are never blocked */
+		watermark = event_watermark();
+		num = queue.num;
+		{
+			struct rss_event *tmp = queue.ev;
+			size_t tmpalloc = queue.alloc;
+			queue.ev = ev;
+			queue.alloc = alloc;
+			ev = tmp;
+			alloc = tmpalloc;
+		}
+		queue.num = 0;
+		pthread_mutex_unlock(&queue.lock);
+
+		/*
+		 * The CPUs deliver their events with different lag, so a
+		 * later batch may still bring older events of another CPU.
+		 * Events past the watermark are held for the next batch.
+		 */
+		if (num_held + num > held_alloc) {
+			size_t newalloc = held_alloc ? held_alloc : 1024;
+			struct rss_event *newheld;
+
+			while (newalloc < num_held + num)
+				newalloc *= 2;
+			newheld = realloc(held, newalloc * sizeof(*held));
+			if (!newheld) {
+				perror("Allocate held events");
+				/* account what is there, in the wrong order */
+				account_held(held, &num_held, UINT64_MAX);
+				account_held(ev, &num, UINT64_MAX);
+				num = 0;
+			} else {
+				held = newheld;
+				held_alloc = newalloc;
+			}
+		}
+		memcpy(held + num_held, ev, num * sizeof(*ev));
+		num_held += num;
+		account_held(held, &num_held, watermark);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (checkpoint_ms &&
+		    elapsed_ms(&last_checkpoint, &now) >= (long)checkpoint_ms) {
+			print_checkpoint();
+			fflush(stdout);
+			last_checkpoint = now;
+		}
+
+		if (terminate) {
+			if (!deadline.tv_sec) {
+				deadline = now;
+				deadline.tv_sec += SIGTERM_WAIT;
+			} else if (now.tv_sec > deadline.tv_sec ||
+				   (now.tv_sec == deadline.tv_sec &&
+				    now.tv_nsec >= deadline.tv_nsec)) {
+				account_held(held, &num_held, UINT64_MAX);
+				print_summary();
+				print_samples();
+				print_overruns();
+				fflush(stdout);
+				_exit(0);
+			}
+		}
+	}
+}
+
 static int mount_failure(const char *what)
 {
 	perror(what);
@@ -433,10 +1347,12 @@ static int write_tracefs(const char *subpath, const char *content)
 		perror(subpath);
 		return 1;
 	}
+	/* the kernel checks the value when the buffer is flushed */
 	ret = fputs(content, f) < 0;
+	if (fclose(f))
+		ret = 1;
 	if (ret)
 		perror(subpath);
-	fclose(f);
 	return ret;
 }
 
@@ -445,10 +1361,16 @@ static int init_tracing(void)
 
 	int ret;
 
-	ret = write_tracefs("saved_cmdlines_size", "256");
+	ret = write_tracefs("buffer_size_kb", TRACE_BUFFER_KB);
 	if (ret)
 		return ret;
 
+	/* wake up readers as soon as there is any data; may not exist */
+	write_tracefs("buffer_percent", "0");
+
+	/* timestamps comparable with the time a reader has been idle */
+	mono_trace_clock = !write_tracefs("trace_clock", "mono");
+
 	ret = write_tracefs("events/kmem/rss_stat/filter", "member == 1");
 	if (ret)
 		return ret;
@@ -457,10 +1379,6 @@ static int init_tracing(void)
 	if (ret)
 		return ret;
 
-	ret = write_tracefs("trace_options", "noirq-info");
-	if (ret)
-		return ret;
-
 	return write_tracefs("tracing_on", "1");
 }
 
@@ -484,25 +1402,105 @@ static void print_meminfo(char **info, int num)
 
 static int console_fd = -1;
 
+/*
+ * Find the device number of a named virtio serial port.
+ * Returns non-zero if the port does not exist, e.g. because
+ * virtio_console is not built into the kernel.
+ */
+static int find_virtio_port(const char *name, dev_t *dev)
+{
+	char path[PATH_MAX];
+	char buf[256];
+	unsigned maj, min;
+	DIR *dir;
+	struct dirent *d;
+	FILE *f;
+	int ret = 1;
+
+	dir = opendir(VIRTIO_PORTS_DIR);
+	if (!dir)
+		return 1;
+
+	while (ret && (d = readdir(dir))) {
+		if (d->d_name[0] == '.')
+			continue;
+
+		snprintf(path, PATH_MAX, "%s/%s/name",
+			 VIRTIO_PORTS_DIR, d->d_name);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (!fgets(buf, sizeof(buf), f))
+			buf[0] = 0;
+		fclose(f);
+		buf[strcspn(buf, "\n")] = 0;
+		if (strcmp(buf, name))
+			continue;
+
+		snprintf(path, PATH_MAX, "%s/%s/dev",
+			 VIRTIO_PORTS_DIR, d->d_name);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (fscanf(f, "%u:%u", &maj, &min) == 2) {
+			*dev = makedev(maj, min);
+			ret = 0;
+		}
+		fclose(f);
+	}
+
+	closedir(dir);
+	return ret;
+}
+
+/*
+ * Open the log device. Options:
+ *   trackrss=<major>,<minor>   serial port (default ttyS1)
+ *   trackrss=port:<name>       virtio serial port, preferred if it exists
+ *   trackrss.checkpoint=<ms>   print a checkpoint line every <ms>
+ *   trackrss.sample=<ms>       sample kernel memory every <ms> (0: never)
+ */
 static int open_console(char *argv[])
 {
         static const char opt[] = "trackrss=";
+        static const char portopt[] = "port:";
+        static const char checkopt[] = "trackrss.checkpoint=";
+        static const char sampleopt[] = "trackrss.sample=";
         dev_t dev = LOG_DEV;
+        const char *port = NULL;
         char **arg, **lastarg;
         for (arg = lastarg = &argv[1]; *arg; ++arg) {
                 if (strncmp(*arg, opt, sizeof(opt) - 1) == 0) {
                         char *p = *arg + sizeof(opt) - 1;
                         int maj, min;
+                        if (strncmp(p, portopt, sizeof(portopt) - 1) == 0) {
+                                port = p + sizeof(portopt) - 1;
+                                continue;
+                        }
                         if (sscanf(p, "%d,%d", &maj, &min) != 2) {
                                 fprintf(stderr, "Invalid option: %s\n", *arg);
                                 return 1;
                         }
                         dev = makedev(maj, min);
+                } else if (strncmp(*arg, checkopt, sizeof(checkopt) - 1) == 0) {
+                        checkpoint_ms = strtoul(*arg + sizeof(checkopt) - 1,
+                                                NULL, 10);
+                } else if (strncmp(*arg, sampleopt, sizeof(sampleopt) - 1) == 0) {
+                        sample_ms = strtoul(*arg + sizeof(sampleopt) - 1,
+                                            NULL, 10);
                 } else
                         *lastarg++ = *arg;
         }
         *lastarg = NULL;
 
+        if (port) {
+                if (find_virtio_port(port, &dev) == 0)
+                        log_delay_us = 0;
+                else
+                        fprintf(stderr, "Virtio port %s not found, "
+                                "using serial port\n", port);
+        }
+
 	if (mknod(LOG_CONSOLE, S_IFCHR | 0660, dev) < 0) {
 		perror("create console");
 		return 1;
@@ -598,23 +1596,21 @@ static int start_systemd(char *argv[])
 
 static void sigterm_handler(int signo)
 {
-	alarm(SIGTERM_WAIT);
-}
-
-static void sigalrm_handler(int signo)
-{
-	_exit(0);
+	terminate = 1;
 }
 
 int main(int argc, char *argv[])
 {
-	struct connection conn;
 	char *meminfo[MAX_MEMINFO_LINES];
 	int infonum;
 	int ret;
 
         signal(SIGTERM, sigterm_handler);
-	signal(SIGALRM, sigalrm_handler);
+
+	/* sysfs is needed to find a virtio port */
+	ret = init_mounts();
+	if (ret)
+		return ret;
 
         ret = open_console(argv);
         if (ret)
@@ -624,36 +1620,34 @@ int main(int argc, char *argv[])
 	if (ret)
 		return ret;
 
-	ret = init_mounts();
-	if (ret)
-		return ret;
-
 	infonum = get_meminfo(meminfo, MAX_MEMINFO_LINES);
 	if (infonum < 0)
 		return 1;
 
-	ret = init_tracing();
+	ret = read_format();
 	if (ret)
 		return ret;
 
-	ret = conn_init(&conn);
+	ret = init_tracing();
 	if (ret)
-		goto done;
+		return ret;
 
 	if (start_systemd(argv))
 		return 1;
 
+	/* threads do not survive fork(), so start them in the child */
+	if (start_readers())
+		return 1;
+
+	if (start_sampler())
+		return 1;
+
 	if (print_vmcoreinfo())
 		return 1;
 
 	print_meminfo(meminfo, infonum);
 	free_meminfo(meminfo, infonum);
 
-	while (!ret) {
-		ret = get_trace(&conn);
-	}
-
- done:
-	conn_cleanup(&conn);
-	return ret;
+	process_events();
+	return 0;
 }
@@ -0,0 +1,804 @@
+/*
+ * Copyright (c) 2025 SUSE LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses>.
+ */
+
+/*
+ * Copy /proc/vmcore to an ELF vmcore with several threads.
+ *
+ * The ELF headers and the PT_LOAD segments of the input are cut into
+ * blocks, which the threads read with pread(2). If the output is a
+ * regular file, it gets its final size first, and each thread writes
+ * its blocks to the same offsets with pwrite(2), so the threads never
+ * wait for each other; pages that are all zero are left as holes.
+ * Otherwise (a pipe or "-" for stdout) the blocks are written in order.
+ * Either way the result is the same ELF file as the input.
+ *
+ * Each thread also computes the CRC32C of its blocks, and the CRCs are
+ * combined in file order for the digest, which is the same as that of
+ * kdump-write. When writing to a file, the free space of the file system
+ * is checked as the blocks are written.
+ */
+
+#define _GNU_SOURCE
+
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "kdump-util.h"
+
+#define MiB		(1024UL * 1024UL)
+
+/* Default block size */
+#define DEF_BLOCK	(1 * MiB)
+
+/* Zero check granularity */
+#define PAGE		4096
+
+/* Free space is checked whenever this much has been written */
+#define SPACE_CHECK	(16 * MiB)
+
+const char *progname = "kdump-elfdump";
+
+/* a part of the input that is copied */
+struct range {
+	unsigned long long off, len;
+};
+
+struct slot {
+	unsigned char *buf;
+	size_t len;
+	int ready;			/* block can be written */
+};
+
+struct elfdump {
+	int in, out;
+	const char *path, *outpath;
+	unsigned long long size;	/* size of the ELF file */
+	size_t block;			/* block size */
+
+	struct range *ranges;		/* sorted, not overlapping */
+	unsigned int nranges;
+	struct range *blocks;		/* the ranges cut into blocks */
+	unsigned long long nblocks;
+
+	int stream;			/* write the blocks in order */
+	int use_sync;			/* sync_file_range() works */
+	struct slot *slots;		/* block n is in slot n % nslots */
+	unsigned int nslots;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned long long next;	/* next block to read */
+	unsigned long long written;	/* blocks written so far (stream) */
+	int failed;
+
+	unsigned long long zero_pages;
+
+	unsigned long long min_free;	/* stop below this free space */
+	unsigned long long data;	/* bytes written (file) */
+	unsigned long long space_checked; /* data at the last check */
+
+	const char *digest;		/* where to store the digest */
+	unsigned int *crcs;		/* CRC32C of each block */
+};
+
+/* Multiply @a and @b modulo the CRC polynomial (bit-reflected). */
+static unsigned int crc32c_mult(unsigned int a, unsigned int b)
+{
+	unsigned int m = 1U << 31, p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if (!(a & (m - 1)))
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+	}
+	return p;
+}
+
+/*
+ * Advance @crc over @len zero bytes, i.e. multiply it by x^(8 * len),
+ * using the powers x^(2^n) computed by squaring.
+ */
+static unsigned int crc32c_shift(unsigned int crc, unsigned long long len)
+{
+	unsigned int x = 1U << 30;	/* x^1 */
+	int n;
+
+	len <<= 3;
+	for (n = 0; len; ++n, len >>= 1) {
+		if (n)
+			x = crc32c_mult(x, x);
+		if (len & 1)
+			crc = crc32c_mult(x, crc);
+	}
+	return crc;
+}
+
+static int failure(const char *what, const char *path)
+{
+	fprintf(stderr, "%s: %s %s: %s\n", progname, what, path,
+		strerror(errno));
+	return -1;
+}
+
+/* Check if a page at @p (aligned to 8 bytes) is all zero. */
+static int is_zero(const unsigned char *p)
+{
+	const uint64_t *q = (const uint64_t *)p;
+	uint64_t acc = 0;
+	size_t i;
+
+	for (i = 0; i < PAGE / sizeof(uint64_t); ++i)
+		acc |= q[i];
+	return !acc;
+}
+
+static int read_all(struct elfdump *e, void *buf, size_t len,
+		    unsigned long long off)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = pread(e->in, (char *)buf + done, len - done, off + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return failure("Cannot read", e->path);
+		if (ret == 0) {
+			fprintf(stderr, "%s: %s: Unexpected end of file\n",
+				progname, e->path);
+			return -1;
+		}
+		done += ret;
+	}
+	return 0;
+}
+
+static int add_range(struct elfdump *e, unsigned long long off,
+		     unsigned long long len)
+{
+	struct range *r;
+
+	if (!len)
+		return 0;
+	r = realloc(e->ranges, (e->nranges + 1) * sizeof(*r));
+	if (!r) {
+		fprintf(stderr, "%s: Cannot allocate ranges\n", progname);
+		return -1;
+	}
+	e->ranges = r;
+	r[e->nranges].off = off;
+	r[e->nranges].len = len;
+	++e->nranges;
+	return 0;
+}
+
+static int cmp_range(const void *a, const void *b)
+{
+	const struct range *x = a, *y = b;
+
+	return x->off < y->off ? -1 : x->off > y->off;
+}
+
+/*
+ * Find the parts of the input to copy: the ELF headers up to the first
+ * segment, and all PT_NOTE and PT_LOAD segments.
+ */
+static int read_elf(struct elfdump *e)
+{
+	union {
+		unsigned char ident[EI_NIDENT];
+		Elf32_Ehdr e32;
+		Elf64_Ehdr e64;
+	} ehdr;
+	unsigned long long phoff, shoff, first, end, i;
+	unsigned int phnum, phentsize;
+	unsigned char *phdrs;
+	int is64;
+
+	if (read_all(e, &ehdr, sizeof(ehdr.e32), 0))
+		return -1;
+	if (memcmp(ehdr.ident, ELFMAG, SELFMAG) ||
+	    (ehdr.ident[EI_CLASS] != ELFCLASS32 &&
+	     ehdr.ident[EI_CLASS] != ELFCLASS64)) {
+		fprintf(stderr, "%s: %s is not an ELF file\n", progname,
+			e->path);
+		return -1;
+	}
+	is64 = ehdr.ident[EI_CLASS] == ELFCLASS64;
+	if (is64 && read_all(e, &ehdr, sizeof(ehdr.e64), 0))
+		return -1;
+	phoff = is64 ? ehdr.e64.e_phoff : ehdr.e32.e_phoff;
+	shoff = is64 ? ehdr.e64.e_shoff : ehdr.e32.e_shoff;
+	phnum = is64 ? ehdr.e64.e_phnum : ehdr.e32.e_phnum;
+	phentsize = is64 ? ehdr.e64.e_phentsize : ehdr.e32.e_phentsize;
+	if (phentsize != (is64 ? sizeof(Elf64_Phdr) : sizeof(Elf32_Phdr))) {
+		fprintf(stderr, "%s: %s: Invalid program header size\n",
+			progname, e->path);
+		return -1;
+	}
+
+	/* more segments than fit into e_phnum */
+	if (phnum == PN_XNUM) {
+		Elf64_Shdr s64;
+		Elf32_Shdr s32;
+
+		if (is64 ? read_all(e, &s64, sizeof(s64), shoff) :
+		    read_all(e, &s32, sizeof(s32), shoff))
+			return -1;
+		phnum = is64 ? s64.sh_info : s32.sh_info;
+	}
+
+	phdrs = malloc((size_t)phnum * phentsize + 1);
+	if (!phdrs) {
+		fprintf(stderr, "%s: Cannot allocate program headers\n",
+			progname);
+		return -1;
+	}
+	if (read_all(e, phdrs, (size_t)phnum * phentsize, phoff)) {
+		free(phdrs);
+		return -1;
+	}
+
+	first = e->size;
+	for (i = 0; i < phnum; ++i) {
+		unsigned long long off, len;
+		unsigned int type;
+
+		if (is64) {
+			Elf64_Phdr *p = (Elf64_Phdr *)phdrs + i;
+			type = p->p_type;
+			off = p->p_offset;
+			len = p->p_filesz;
+		} else {
+			Elf32_Phdr *p = (Elf32_Phdr *)phdrs + i;
+			type = p->p_type;
+			off = p->p_offset;
+			len = p->p_filesz;
+		}
+		if ((type != PT_LOAD && type != PT_NOTE) || !len)
+			continue;
+		if (off + len > e->size || off + len < off) {
+			fprintf(stderr, "%s: %s: Segment beyond the end of "
+				"the file\n", progname, e->path);
+			free(phdrs);
+			return -1;
+		}
+		if (off < first)
+			first = off;
+		if (add_range(e, off, len)) {
+			free(phdrs);
+			return -1;
+		}
+	}
+	free(phdrs);
+	if (add_range(e, 0, first) ||
+	    add_range(e, phoff, (unsigned long long)phnum * phentsize))
+		return -1;
+
+	/* merge overlapping ranges; the end of the last one is the size */
+	qsort(e->ranges, e->nranges, sizeof(*e->ranges), cmp_range);
+	end = 0;
+	for (i = 0; i < e->nranges; ++i) {
+		struct range *r = &e->ranges[i];
+		struct range *prev = i ? &e->ranges[i - 1] : NULL;
+
+		if (prev && r->off <= prev->off + prev->len) {
+			if (r->off + r->len > prev->off + prev->len)
+				prev->len = r->off + r->len - prev->off;
+			memmove(r, r + 1, (e->nranges - i - 1) * sizeof(*r));
+			--e->nranges;
+			--i;
+			continue;
+		}
+	}
+	for (i = 0; i < e->nranges; ++i)
+		if (e->ranges[i].off + e->ranges[i].len > end)
+			end = e->ranges[i].off + e->ranges[i].len;
+	e->size = end;
+	return 0;
+}
+
+/* Cut the ranges into blocks of at most the block size. */
+static int cut_blocks(struct elfdump *e)
+{
+	unsigned long long n = 0, off, len;
+	unsigned int i;
+
+	for (i = 0; i < e->nranges; ++i)
+		n += (e->ranges[i].len + e->block - 1) / e->block;
+	e->blocks = malloc(n * sizeof(*e->blocks) + 1);
+	if (!e->blocks) {
+		fprintf(stderr, "%s: Cannot allocate blocks\n", progname);
+		return -1;
+	}
+	for (i = 0; i < e->nranges; ++i) {
+		off = e->ranges[i].off;
+		for (len = e->ranges[i].len; len; ) {
+			struct range *b = &e->blocks[e->nblocks++];
+			b->off = off;
+			b->len = len < e->block ? len : e->block;
+			off += b->len;
+			len -= b->len;
+		}
+	}
+	return 0;
+}
+
+static void set_failed(struct elfdump *e)
+{
+	pthread_mutex_lock(&e->lock);
+	e->failed = 1;
+	pthread_cond_broadcast(&e->cond);
+	pthread_mutex_unlock(&e->lock);
+}
+
+static int pwrite_all(struct elfdump *e, const unsigned char *buf,
+		      size_t len, unsigned long long off)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(e->out, buf, len, off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return failure("Cannot write", e->outpath);
+		buf += ret;
+		off += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/*
+ * Stop before the file system has less than min_free bytes available.
+ * The file is sparse, so only the data written so far takes space.
+ */
+static int check_space(struct elfdump *e, unsigned long long len)
+{
+	unsigned long long data, checked, avail;
+	struct statvfs st;
+
+	if (!e->min_free)
+		return 0;
+	data = __atomic_add_fetch(&e->data, len, __ATOMIC_RELAXED);
+	checked = __atomic_load_n(&e->space_checked, __ATOMIC_RELAXED);
+	if (data - checked < SPACE_CHECK ||
+	    !__atomic_compare_exchange_n(&e->space_checked, &checked, data, 0,
+					 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return 0;
+	if (fstatvfs(e->out, &st))
+		return 0;
+	avail = (unsigned long long)st.f_bavail * st.f_frsize;
+	if (avail >= e->min_free)
+		return 0;
+
+	fprintf(stderr, "%s: %s: Less than %llu MiB free, stopped after "
+		"%llu bytes\n", progname, e->outpath, e->min_free / MiB, data);
+	return -1;
+}
+
+/* Write the pages of block @b that are not all zero. */
+static int write_block(struct elfdump *e, const struct range *b,
+		       const unsigned char *buf)
+{
+	size_t pos = 0, start, len;
+	unsigned long long zero = 0, data = 0;
+
+	while (pos < b->len) {
+		/* skip zero pages */
+		while (pos + PAGE <= b->len && is_zero(buf + pos)) {
+			pos += PAGE;
+			++zero;
+		}
+		start = pos;
+		while (pos < b->len &&
+		       (pos + PAGE > b->len || !is_zero(buf + pos)))
+			pos += pos + PAGE <= b->len ? PAGE : b->len - pos;
+		len = pos - start;
+		if (len && pwrite_all(e, buf + start, len, b->off + start))
+			return -1;
+		data += len;
+	}
+	if (zero)
+		__atomic_add_fetch(&e->zero_pages, zero, __ATOMIC_RELAXED);
+	return check_space(e, data);
+}
+
+/*
+ * Start write-back of block @b, then wait for the previous block of the
+ * thread and drop it from the page cache, which is small in the kdump
+ * kernel.
+ */
+static int flush_block(struct elfdump *e, const struct range *b,
+		       const struct range *prev)
+{
+	if (!e->use_sync)
+		return 0;
+	if (sync_file_range(e->out, b->off, b->len, SYNC_FILE_RANGE_WRITE))
+		return failure("Cannot write back", e->outpath);
+	if (prev) {
+		if (sync_file_range(e->out, prev->off, prev->len,
+				    SYNC_FILE_RANGE_WAIT_BEFORE |
+				    SYNC_FILE_RANGE_WRITE |
+				    SYNC_FILE_RANGE_WAIT_AFTER))
+			return failure("Cannot write back", e->outpath);
+		posix_fadvise(e->out, prev->off, prev->len,
+			      POSIX_FADV_DONTNEED);
+	}
+	return 0;
+}
+
+static unsigned long long claim_block(struct elfdump *e)
+{
+	unsigned long long n;
+
+	pthread_mutex_lock(&e->lock);
+	/* in stream mode, the slot is free when its last block is written */
+	while (e->stream && !e->failed && e->next < e->nblocks &&
+	       e->next - e->written >= e->nslots)
+		pthread_cond_wait(&e->cond, &e->lock);
+	n = e->failed ? e->nblocks : e->next;
+	if (n < e->nblocks)
+		++e->next;
+	pthread_mutex_unlock(&e->lock);
+	return n;
+}
+
+/* Copy blocks in the order they are claimed, until all are done. */
+static void *worker(void *arg)
+{
+	struct elfdump *e = arg;
+	const struct range *b, *prev = NULL;
+	unsigned char *buf = NULL;
+	unsigned long long n;
+	struct slot *s;
+
+	if (!e->stream &&
+	    posix_memalign((void **)&buf, PAGE, e->block)) {
+		fprintf(stderr, "%s: Cannot allocate buffers\n", progname);
+		set_failed(e);
+		return NULL;
+	}
+
+	while ((n = claim_block(e)) < e->nblocks) {
+		b = &e->blocks[n];
+		if (!e->stream) {
+			if (read_all(e, buf, b->len, b->off)) {
+				set_failed(e);
+				break;
+			}
+			if (e->crcs)
+				e->crcs[n] = crc32c_update(0, buf, b->len);
+			if (write_block(e, b, buf) || flush_block(e, b, prev)) {
+				set_failed(e);
+				break;
+			}
+			prev = b;
+			continue;
+		}
+
+		s = &e->slots[n % e->nslots];
+		if (read_all(e, s->buf, b->len, b->off)) {
+			set_failed(e);
+			break;
+		}
+		if (e->crcs)
+			e->crcs[n] = crc32c_update(0, s->buf, b->len);
+		s->len = b->len;
+		pthread_mutex_lock(&e->lock);
+		s->ready = 1;
+		pthread_cond_broadcast(&e->cond);
+		pthread_mutex_unlock(&e->lock);
+	}
+
+	if (prev && e->use_sync)
+		posix_fadvise(e->out, prev->off, prev->len,
+			      POSIX_FADV_DONTNEED);
+	free(buf);
+	return NULL;
+}
+
+static int write_all(struct elfdump *e, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(e->out, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return failure("Cannot write", e->outpath);
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* Write zeros for a gap between the ranges in stream mode. */
+static int write_gap(struct elfdump *e, unsigned long long len)
+{
+	static const unsigned char zero[PAGE];
+	size_t chunk;
+
+	for (; len; len -= chunk) {
+		chunk = len < sizeof(zero) ? len : sizeof(zero);
+		if (write_all(e, zero, chunk))
+			return -1;
+	}
+	return 0;
+}
+
+/* Write the blocks in order as they become ready. */
+static int write_stream(struct elfdump *e)
+{
+	unsigned long long n, pos = 0;
+	struct slot *s;
+
+	for (n = 0; n < e->nblocks; ++n) {
+		s = &e->slots[n % e->nslots];
+		pthread_mutex_lock(&e->lock);
+		while (!s->ready && !e->failed)
+			pthread_cond_wait(&e->cond, &e->lock);
+		pthread_mutex_unlock(&e->lock);
+		if (e->failed)
+			return -1;
+
+		if (write_gap(e, e->blocks[n].off - pos) ||
+		    write_all(e, s->buf, s->len))
+			return -1;
+		pos = e->blocks[n].off + s->len;
+
+		pthread_mutex_lock(&e->lock);
+		s->ready = 0;
+		e->written = n + 1;
+		pthread_cond_broadcast(&e->cond);
+		pthread_mutex_unlock(&e->lock);
+	}
+	return 0;
+}
+
+static int open_output(struct elfdump *e, unsigned int threads)
+{
+	struct stat st;
+	unsigned int i;
+
+	if (!strcmp(e->outpath, "-")) {
+		e->out = STDOUT_FILENO;
+		e->outpath = "stdout";
+	} else {
+		e->out = open(e->outpath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (e->out < 0)
+			return failure("Cannot create", e->outpath);
+	}
+	if (fstat(e->out, &st))
+		return failure("Cannot stat", e->outpath);
+
+	if (S_ISREG(st.st_mode)) {
+		/* the threads fill in the file; zero pages remain holes */
+		if (ftruncate(e->out, e->size))
+			return failure("Cannot resize", e->outpath);
+		/* probe once; the threads only read the flag */
+		e->use_sync = !sync_file_range(e->out, 0, 0,
+					       SYNC_FILE_RANGE_WRITE);
+		return 0;
+	}
+
+	/* one block ahead for each thread keeps the writer busy */
+	e->stream = 1;
+	e->nslots = threads * 2;
+	e->slots = calloc(e->nslots, sizeof(struct slot));
+	if (!e->slots)
+		goto nomem;
+	for (i = 0; i < e->nslots; ++i)
+		if (posix_memalign((void **)&e->slots[i].buf, PAGE, e->block))
+			goto nomem;
+	return 0;
+
+nomem:
+	fprintf(stderr, "%s: Cannot allocate buffers\n", progname);
+	return -1;
+}
+
+/*
+ * Combine the CRCs of the blocks in file order; gaps between the ranges
+ * are zeros. The digest file has the same format as that of kdump-write.
+ */
+static int write_digest(struct elfdump *e)
+{
+	unsigned long long n, pos = 0;
+	unsigned int crc = ~0U;
+	FILE *f;
+
+	for (n = 0; n < e->nblocks; ++n) {
+		crc = crc32c_shift(crc, e->blocks[n].off + e->blocks[n].len - pos);
+		crc ^= e->crcs[n];
+		pos = e->blocks[n].off + e->blocks[n].len;
+	}
+
+	f = fopen(e->digest, "w");
+	if (!f)
+		return failure("Cannot create", e->digest);
+	fprintf(f, "crc32c %08x %llu\n", ~crc, pos);
+	if (fclose(f))
+		return failure("Cannot write", e->digest);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [options] <input> <output>\n"
+		"\n"
+		"Copy the ELF file <input> (usually /proc/vmcore) to <output>\n"
+		"with several threads. <output> can be \"-\" for stdout.\n"
+		"\n"
+		"Options:\n"
+		"  -t, --threads=N         copy threads (default: CPUs)\n"
+		"  -b, --block-size=SIZE   unit of work of a thread (default 1M)\n"
+		"  -d, --digest=FILE       store the CRC32C and size of the data\n"
+		"  -f, --min-free=SIZE     stop if less than SIZE remains free\n"
+		"  -q, --quiet             do not report the throughput\n",
+		progname);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "threads", 1, 0, 't' },
+		{ "block-size", 1, 0, 'b' },
+		{ "digest", 1, 0, 'd' },
+		{ "min-free", 1, 0, 'f' },
+		{ "quiet", 0, 0, 'q' },
+		{ "help", 0, 0, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+	struct elfdump e = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	unsigned long long block = DEF_BLOCK;
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	struct timespec start, end;
+	pthread_t *tids;
+	struct stat st;
+	double secs;
+	int c, i, quiet = 0, ret = 0;
+	char *endptr;
+
+	while ((c = getopt_long(argc, argv, "t:b:d:f:qh", opts, NULL)) != -1) {
+		switch (c) {
+		case 't':
+			threads = strtol(optarg, &endptr, 10);
+			if (*endptr || endptr == optarg || threads < 1) {
+				fprintf(stderr, "%s: Invalid number of threads: %s\n",
+					progname, optarg);
+				return 2;
+			}
+			break;
+		case 'b':
+			if (parse_size(optarg, &block))
+				return 2;
+			break;
+		case 'd':
+			e.digest = optarg;
+			break;
+		case 'f':
+			if (parse_size(optarg, &e.min_free))
+				return 2;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'h':
+			usage();
+			return 0;
+		default:
+			usage();
+			return 2;
+		}
+	}
+	if (argc - optind != 2 || !block || block % PAGE ||
+	    block > 256 * MiB) {
+		usage();
+		return 2;
+	}
+	if (threads < 1)
+		threads = 1;
+	e.block = block;
+	e.path = argv[optind];
+	e.outpath = argv[optind + 1];
+
+	e.in = open(e.path, O_RDONLY);
+	if (e.in < 0)
+		return -failure("Cannot open", e.path);
+	if (fstat(e.in, &st))
+		return -failure("Cannot stat", e.path);
+	e.size = st.st_size;
+	if (read_elf(&e) || cut_blocks(&e) || open_output(&e, threads))
+		return 1;
+	if (e.digest) {
+		crc32c_init();
+		e.crcs = malloc(e.nblocks * sizeof(*e.crcs) + 1);
+		if (!e.crcs) {
+			fprintf(stderr, "%s: Cannot allocate CRCs\n", progname);
+			return 1;
+		}
+	}
+	/* the free space of a pipe is not the free space of the target */
+	if (e.stream)
+		e.min_free = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	tids = calloc(threads, sizeof(pthread_t));
+	if (!tids) {
+		fprintf(stderr, "%s: Cannot allocate threads\n", progname);
+		return 1;
+	}
+	for (i = 0; i < threads; ++i) {
+		errno = pthread_create(&tids[i], NULL, worker, &e);
+		if (errno) {
+			failure("Cannot create thread for", e.path);
+			set_failed(&e);
+			threads = i;
+			break;
+		}
+	}
+	if (e.stream && write_stream(&e))
+		set_failed(&e);
+	for (i = 0; i < threads; ++i)
+		pthread_join(tids[i], NULL);
+	if (e.failed)
+		ret = 1;
+	else if (!e.stream && fdatasync(e.out) && errno != EINVAL)
+		ret = -failure("Cannot sync", e.outpath);
+	close(e.in);
+	if (e.out != STDOUT_FILENO && close(e.out) && !ret)
+		ret = -failure("Cannot close", e.outpath);
+	if (!ret && e.digest)
+		ret = write_digest(&e);
+	if (ret)
+		return ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+	if (!quiet)
+		fprintf(stderr, "%s: %llu bytes in %.1f s (%.1f MiB/s, "
+			"%llu zero pages, %ld threads)\n",
+			e.path, e.size, secs,
+			secs > 0 ? e.size / secs / MiB : 0.0,
+			e.zero_pages, threads);
+	return 0;
+}
@@ -0,0 +1,293 @@
+/*
+ * Copyright (c) 2025 SUSE LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses>.
+ */
+
+/*
+ * Wait until a TCP service on the dump target accepts connections.
+ *
+ * Connections to all addresses of the host are attempted without
+ * blocking. A new round of attempts starts as soon as rtnetlink reports
+ * a change of links, addresses or routes, or after a retry interval, so
+ * the program exits the moment the service is reachable. Unlike ping,
+ * this works through firewalls that drop ICMP and tests the port that
+ * is actually used for the dump.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+/* Default time to wait in seconds */
+#define DEF_TIMEOUT	30
+
+/* Milliseconds before a round of connection attempts is repeated */
+#define RETRY_INTERVAL	1000
+
+/* Maximum number of addresses tried at the same time */
+#define MAX_ADDRS	8
+
+static const char *progname = "kdump-netwait";
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Subscribe to link, address and route changes. */
+static int netlink_open(void)
+{
+	struct sockaddr_nl sa = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = RTMGRP_LINK |
+			RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR |
+			RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE,
+	};
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    NETLINK_ROUTE);
+	if (fd < 0)
+		return -1;
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Read all pending netlink messages; any of them is a change. */
+static void netlink_drain(int fd)
+{
+	char buf[8192];
+
+	while (recv(fd, buf, sizeof(buf), 0) > 0 || errno == EINTR)
+		;
+}
+
+/*
+ * Start a non-blocking connection to every address in @res. Returns 1 if
+ * one of them connected immediately; otherwise the pending sockets are
+ * stored in @pfds and their number in @n.
+ */
+static int start_connect(struct addrinfo *res, struct pollfd *pfds, int *n,
+			 int *err)
+{
+	struct addrinfo *ai;
+	int fd;
+
+	*n = 0;
+	for (ai = res; ai && *n < MAX_ADDRS; ai = ai->ai_next) {
+		fd = socket(ai->ai_family,
+			    ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			    ai->ai_protocol);
+		if (fd < 0) {
+			*err = errno;
+			continue;
+		}
+		if (!connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+			close(fd);
+			return 1;
+		}
+		if (errno != EINPROGRESS) {
+			*err = errno;
+			close(fd);
+			continue;
+		}
+		pfds[*n].fd = fd;
+		pfds[*n].events = POLLOUT;
+		++*n;
+	}
+	return 0;
+}
+
+static void close_all(struct pollfd *pfds, int n)
+{
+	int i;
+
+	for (i = 0; i < n; ++i)
+		if (pfds[i].fd >= 0)
+			close(pfds[i].fd);
+}
+
+/*
+ * Wait for the pending connections until one succeeds (returns 1), the
+ * network configuration changes or the round ends at @until (returns 0).
+ */
+static int wait_connect(int nl, struct pollfd *socks, int n, double until,
+			int *err)
+{
+	struct pollfd pfds[MAX_ADDRS + 1];
+	int i, ret, soerr;
+	socklen_t len;
+	double left;
+
+	for (;;) {
+		for (i = 0; i < n; ++i)
+			pfds[i] = socks[i];
+		pfds[n].fd = nl;
+		pfds[n].events = POLLIN;
+
+		left = until - now();
+		if (left <= 0)
+			return 0;
+		ret = poll(pfds, n + 1, left * 1000 + 1);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return 0;
+
+		for (i = 0; i < n; ++i) {
+			if (socks[i].fd < 0 || !pfds[i].revents)
+				continue;
+			len = sizeof(soerr);
+			if (getsockopt(socks[i].fd, SOL_SOCKET, SO_ERROR,
+				       &soerr, &len))
+				soerr = errno;
+			if (!soerr)
+				return 1;
+			*err = soerr;
+			close(socks[i].fd);
+			socks[i].fd = -1;
+		}
+
+		/* start over, pending attempts may use an old route */
+		if (nl >= 0 && pfds[n].revents) {
+			netlink_drain(nl);
+			return 0;
+		}
+	}
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [options] <host> <port>\n"
+		"\n"
+		"Wait until <host> accepts TCP connections on <port>.\n"
+		"\n"
+		"Options:\n"
+		"  -t, --timeout=SECONDS   give up after SECONDS (default 30)\n"
+		"  -q, --quiet             do not report the waiting time\n",
+		progname);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "timeout", 1, 0, 't' },
+		{ "quiet", 0, 0, 'q' },
+		{ "help", 0, 0, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo *res = NULL;
+	struct pollfd socks[MAX_ADDRS];
+	const char *host, *port;
+	double start, end, until;
+	int timeout = DEF_TIMEOUT, quiet = 0;
+	int c, n, nl, ret, gai = 0, err = ETIMEDOUT;
+	char *endptr;
+
+	while ((c = getopt_long(argc, argv, "t:qh", opts, NULL)) != -1) {
+		switch (c) {
+		case 't':
+			timeout = strtol(optarg, &endptr, 10);
+			if (*endptr || endptr == optarg || timeout < 0) {
+				fprintf(stderr, "%s: Invalid timeout: %s\n",
+					progname, optarg);
+				return 2;
+			}
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'h':
+			usage();
+			return 0;
+		default:
+			usage();
+			return 2;
+		}
+	}
+	if (argc - optind != 2) {
+		usage();
+		return 2;
+	}
+	host = argv[optind];
+	port = argv[optind + 1];
+
+	start = now();
+	end = start + timeout;
+	/* without netlink, the retry interval still applies */
+	nl = netlink_open();
+
+	for (;;) {
+		/* name resolution may need the network as well */
+		if (!res) {
+			ret = getaddrinfo(host, port, &hints, &res);
+			if (ret) {
+				res = NULL;
+				gai = ret;
+				if (ret != EAI_AGAIN && ret != EAI_SYSTEM &&
+				    ret != EAI_NONAME) {
+					fprintf(stderr, "%s: %s: %s\n", progname,
+						host, gai_strerror(ret));
+					return 1;
+				}
+			}
+		}
+
+		until = now() + RETRY_INTERVAL / 1000.0;
+		if (until > end)
+			until = end;
+		n = 0;
+		if (res && start_connect(res, socks, &n, &err))
+			break;
+		ret = wait_connect(nl, socks, n, until, &err);
+		close_all(socks, n);
+		if (ret)
+			break;
+
+		if (now() >= end) {
+			fprintf(stderr, "%s: %s port %s not reachable within "
+				"%d s: %s\n", progname, host, port, timeout,
+				res ? strerror(err) : gai_strerror(gai));
+			return 1;
+		}
+	}
+
+	if (!quiet)
+		printf("%s port %s reachable after %.1f s\n",
+		       host, port, now() - start);
+	return 0;
+}
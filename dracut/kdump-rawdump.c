@@ -0,0 +1,500 @@
+/*
+ * Copyright (c) 2025 SUSE LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses>.
+ */
+
+/*
+ * Compress a verbatim copy of /proc/vmcore in the Zstandard seekable
+ * format.
+ *
+ * The input is cut into blocks, which are read with pread(2) and
+ * compressed into independent zstd frames by several threads. The frames
+ * are written to the output in order, followed by the seek table in a
+ * skippable frame. Any zstd decoder unpacks the result to the original
+ * file; tools that know the seekable format can read parts of it without
+ * unpacking all of it.
+ *
+ * Blocks that are all zero (free memory) are not compressed: the frame
+ * of a zero block is computed once and reused.
+ */
+
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zstd.h>
+
+#include "kdump-util.h"
+
+#define MiB		(1024UL * 1024UL)
+
+/* Default block size, which is the unit of seeking */
+#define DEF_BLOCK	(1 * MiB)
+
+/* Zero check granularity, and alignment of the blocks */
+#define PAGE		4096
+
+/* Default compression level; the dump must be fast, not small */
+#define DEF_LEVEL	1
+
+/* Zstandard seekable format, see zstd contrib/seekable_format */
+#define SKIPPABLE_MAGIC	0x184D2A5EU
+#define SEEKABLE_MAGIC	0x8F92EAB1U
+
+const char *progname = "kdump-rawdump";
+
+struct slot {
+	unsigned char *in;		/* data read from the input */
+	unsigned char *out;		/* compressed frame */
+	const unsigned char *frame;	/* out, or the zero frame */
+	size_t in_len, frame_len;
+	int ready;			/* frame can be written */
+};
+
+struct rawdump {
+	int in, out;
+	const char *path;
+	unsigned long long size;	/* size of the input */
+	size_t block;			/* block size */
+	unsigned long long nblocks;
+	int level;
+
+	struct slot *slots;		/* block n is in slot n % nslots */
+	unsigned int nslots;
+	size_t bound;			/* size of slot out buffers */
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned long long next;	/* next block to compress */
+	unsigned long long written;	/* blocks written so far */
+	int failed;
+
+	unsigned char *zero_frame;	/* frame of a zero block */
+	size_t zero_len;
+	unsigned long long zero_blocks;
+
+	uint32_t *table;		/* seek table entries */
+	unsigned long long total_out;
+};
+
+static int failure(const char *what, const char *path)
+{
+	fprintf(stderr, "%s: %s %s: %s\n", progname, what, path,
+		strerror(errno));
+	return -1;
+}
+
+/*
+ * Check if @len bytes at @p (aligned to 8 bytes) are all zero. The OR over
+ * a page is vectorised by the compiler; non-zero data usually fails on the
+ * first page.
+ */
+static int is_zero(const unsigned char *p, size_t len)
+{
+	const uint64_t *q = (const uint64_t *)p;
+	size_t words = PAGE / sizeof(uint64_t);
+	uint64_t acc;
+	size_t i;
+
+	for (; len >= PAGE; len -= PAGE, q += words) {
+		acc = 0;
+		for (i = 0; i < words; ++i)
+			acc |= q[i];
+		if (acc)
+			return 0;
+	}
+	p = (const unsigned char *)q;
+	for (i = 0; i < len; ++i)
+		if (p[i])
+			return 0;
+	return 1;
+}
+
+static ZSTD_CCtx *new_cctx(struct rawdump *r)
+{
+	ZSTD_CCtx *cctx = ZSTD_createCCtx();
+
+	if (!cctx) {
+		fprintf(stderr, "%s: Cannot allocate a zstd context\n",
+			progname);
+		return NULL;
+	}
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, r->level);
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+	return cctx;
+}
+
+static int compress_block(struct rawdump *r, ZSTD_CCtx *cctx,
+			  unsigned char *dst, const unsigned char *src,
+			  size_t len, size_t *frame_len)
+{
+	size_t ret = ZSTD_compress2(cctx, dst, r->bound, src, len);
+
+	if (ZSTD_isError(ret)) {
+		fprintf(stderr, "%s: Cannot compress: %s\n", progname,
+			ZSTD_getErrorName(ret));
+		return -1;
+	}
+	*frame_len = ret;
+	return 0;
+}
+
+static void set_failed(struct rawdump *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->failed = 1;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+/* Read block @n into @buf. */
+static int read_block(struct rawdump *r, unsigned long long n,
+		      unsigned char *buf, size_t len)
+{
+	off_t off = n * r->block;
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = pread(r->in, buf + done, len - done, off + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return failure("Cannot read", r->path);
+		if (ret == 0) {
+			fprintf(stderr, "%s: %s: Unexpected end of file\n",
+				progname, r->path);
+			return -1;
+		}
+		done += ret;
+	}
+	return 0;
+}
+
+/* Compress blocks in the order they are claimed, until all are done. */
+static void *worker(void *arg)
+{
+	struct rawdump *r = arg;
+	unsigned long long n;
+	ZSTD_CCtx *cctx;
+	struct slot *s;
+	size_t len;
+
+	cctx = new_cctx(r);
+	if (!cctx) {
+		set_failed(r);
+		return NULL;
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&r->lock);
+		/* the slot is free when its last block has been written */
+		while (!r->failed && r->next < r->nblocks &&
+		       r->next - r->written >= r->nslots)
+			pthread_cond_wait(&r->cond, &r->lock);
+		if (r->failed || r->next >= r->nblocks) {
+			pthread_mutex_unlock(&r->lock);
+			break;
+		}
+		n = r->next++;
+		pthread_mutex_unlock(&r->lock);
+
+		s = &r->slots[n % r->nslots];
+		len = r->size - n * r->block;
+		if (len > r->block)
+			len = r->block;
+		if (read_block(r, n, s->in, len)) {
+			set_failed(r);
+			break;
+		}
+		s->in_len = len;
+		if (len == r->block && is_zero(s->in, len)) {
+			s->frame = r->zero_frame;
+			s->frame_len = r->zero_len;
+			__atomic_add_fetch(&r->zero_blocks, 1, __ATOMIC_RELAXED);
+		} else if (compress_block(r, cctx, s->out, s->in, len,
+					  &s->frame_len)) {
+			set_failed(r);
+			break;
+		} else
+			s->frame = s->out;
+
+		pthread_mutex_lock(&r->lock);
+		s->ready = 1;
+		pthread_cond_broadcast(&r->cond);
+		pthread_mutex_unlock(&r->lock);
+	}
+
+	ZSTD_freeCCtx(cctx);
+	return NULL;
+}
+
+static int write_all(struct rawdump *r, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(r->out, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return failure("Cannot write", "output");
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* Write the frames in order as they become ready. */
+static int write_frames(struct rawdump *r)
+{
+	unsigned long long n;
+	struct slot *s;
+
+	for (n = 0; n < r->nblocks; ++n) {
+		s = &r->slots[n % r->nslots];
+		pthread_mutex_lock(&r->lock);
+		while (!s->ready && !r->failed)
+			pthread_cond_wait(&r->cond, &r->lock);
+		pthread_mutex_unlock(&r->lock);
+		if (r->failed)
+			return -1;
+
+		if (write_all(r, s->frame, s->frame_len))
+			return -1;
+		r->table[2 * n] = htole32(s->frame_len);
+		r->table[2 * n + 1] = htole32(s->in_len);
+		r->total_out += s->frame_len;
+
+		pthread_mutex_lock(&r->lock);
+		s->ready = 0;
+		r->written = n + 1;
+		pthread_cond_broadcast(&r->cond);
+		pthread_mutex_unlock(&r->lock);
+	}
+	return 0;
+}
+
+/* Append the seek table in a skippable frame. */
+static int write_seek_table(struct rawdump *r)
+{
+	unsigned char footer[9];
+	uint32_t header[2], v;
+
+	header[0] = htole32(SKIPPABLE_MAGIC);
+	header[1] = htole32(r->nblocks * 8 + sizeof(footer));
+	if (write_all(r, header, sizeof(header)) ||
+	    write_all(r, r->table, r->nblocks * 8))
+		return -1;
+
+	v = htole32(r->nblocks);
+	memcpy(footer, &v, 4);
+	footer[4] = 0;		/* no checksums in the table */
+	v = htole32(SEEKABLE_MAGIC);
+	memcpy(footer + 5, &v, 4);
+	if (write_all(r, footer, sizeof(footer)))
+		return -1;
+	r->total_out += sizeof(header) + r->nblocks * 8 + sizeof(footer);
+	return 0;
+}
+
+static int setup(struct rawdump *r, unsigned int threads)
+{
+	ZSTD_CCtx *cctx;
+	unsigned char *zero;
+	unsigned int i;
+	int ret;
+
+	r->nblocks = (r->size + r->block - 1) / r->block;
+	if (r->nblocks > 0x8000000ULL) {
+		fprintf(stderr, "%s: %s: Too many blocks, use a larger "
+			"block size\n", progname, r->path);
+		return -1;
+	}
+	r->bound = ZSTD_compressBound(r->block);
+	r->table = malloc(r->nblocks * 8 + 1);
+
+	/* one block ahead for each thread keeps the writer busy */
+	r->nslots = threads * 2;
+	r->slots = calloc(r->nslots, sizeof(struct slot));
+	if (!r->table || !r->slots)
+		goto nomem;
+	for (i = 0; i < r->nslots; ++i) {
+		if (posix_memalign((void **)&r->slots[i].in, PAGE, r->block))
+			goto nomem;
+		r->slots[i].out = malloc(r->bound);
+		if (!r->slots[i].out)
+			goto nomem;
+	}
+
+	zero = calloc(1, r->block);
+	r->zero_frame = malloc(r->bound);
+	if (!zero || !r->zero_frame)
+		goto nomem;
+	cctx = new_cctx(r);
+	if (!cctx)
+		return -1;
+	ret = compress_block(r, cctx, r->zero_frame, zero, r->block,
+			     &r->zero_len);
+	ZSTD_freeCCtx(cctx);
+	free(zero);
+	return ret;
+
+nomem:
+	fprintf(stderr, "%s: Cannot allocate buffers\n", progname);
+	return -1;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [options] <input>\n"
+		"\n"
+		"Compress <input> (usually /proc/vmcore) to stdout in the\n"
+		"Zstandard seekable format.\n"
+		"\n"
+		"Options:\n"
+		"  -t, --threads=N         compression threads (default: CPUs)\n"
+		"  -b, --block-size=SIZE   size of independent frames (default 1M)\n"
+		"  -l, --level=N           zstd compression level (default 1)\n"
+		"  -q, --quiet             do not report the throughput\n",
+		progname);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "threads", 1, 0, 't' },
+		{ "block-size", 1, 0, 'b' },
+		{ "level", 1, 0, 'l' },
+		{ "quiet", 0, 0, 'q' },
+		{ "help", 0, 0, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+	struct rawdump r = {
+		.out = STDOUT_FILENO,
+		.block = DEF_BLOCK,
+		.level = DEF_LEVEL,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	unsigned long long block = DEF_BLOCK;
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	struct timespec start, end;
+	pthread_t *tids;
+	struct stat st;
+	double secs;
+	int c, i, quiet = 0, ret = 0;
+	char *endptr;
+
+	while ((c = getopt_long(argc, argv, "t:b:l:qh", opts, NULL)) != -1) {
+		switch (c) {
+		case 't':
+			threads = strtol(optarg, &endptr, 10);
+			if (*endptr || endptr == optarg || threads < 1) {
+				fprintf(stderr, "%s: Invalid number of threads: %s\n",
+					progname, optarg);
+				return 2;
+			}
+			break;
+		case 'b':
+			if (parse_size(optarg, &block))
+				return 2;
+			break;
+		case 'l':
+			r.level = strtol(optarg, &endptr, 10);
+			if (*endptr || endptr == optarg) {
+				fprintf(stderr, "%s: Invalid level: %s\n",
+					progname, optarg);
+				return 2;
+			}
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'h':
+			usage();
+			return 0;
+		default:
+			usage();
+			return 2;
+		}
+	}
+	if (argc - optind != 1 || !block || block % PAGE ||
+	    block > 256 * MiB) {
+		usage();
+		return 2;
+	}
+	if (threads < 1)
+		threads = 1;
+	r.block = block;
+	r.path = argv[optind];
+
+	r.in = open(r.path, O_RDONLY);
+	if (r.in < 0)
+		return -failure("Cannot open", r.path);
+	if (fstat(r.in, &st))
+		return -failure("Cannot stat", r.path);
+	r.size = st.st_size;
+	if (setup(&r, threads))
+		return 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	tids = calloc(threads, sizeof(pthread_t));
+	if (!tids) {
+		fprintf(stderr, "%s: Cannot allocate threads\n", progname);
+		return 1;
+	}
+	for (i = 0; i < threads; ++i) {
+		errno = pthread_create(&tids[i], NULL, worker, &r);
+		if (errno) {
+			failure("Cannot create thread for", r.path);
+			set_failed(&r);
+			threads = i;
+			break;
+		}
+	}
+	if (write_frames(&r))
+		set_failed(&r);
+	for (i = 0; i < threads; ++i)
+		pthread_join(tids[i], NULL);
+	if (r.failed || write_seek_table(&r))
+		ret = 1;
+	close(r.in);
+	if (ret)
+		return ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+	if (!quiet)
+		fprintf(stderr, "%s: %llu bytes to %llu bytes in %.1f s "
+			"(%.1f MiB/s, %llu zero blocks, %ld threads)\n",
+			r.path, r.size, r.total_out, secs,
+			secs > 0 ? r.size / secs / MiB : 0.0,
+			r.zero_blocks, threads);
+	return 0;
+}
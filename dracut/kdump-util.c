@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2025 SUSE LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/auxv.h>
+
+#include "kdump-util.h"
+
+#if defined(__aarch64__) && !defined(HWCAP_CRC32)
+#define HWCAP_CRC32	(1 << 7)
+#endif
+
+static unsigned int crc_table[8][256];
+
+static unsigned int crc32c_sw(unsigned int crc, const unsigned char *p,
+			      size_t len)
+{
+	unsigned long long v;
+
+	while (len && ((unsigned long)p & 7)) {
+		crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		--len;
+	}
+	while (len >= 8) {
+		memcpy(&v, p, 8);
+		v ^= crc;
+		crc = crc_table[7][v & 0xff] ^
+			crc_table[6][(v >> 8) & 0xff] ^
+			crc_table[5][(v >> 16) & 0xff] ^
+			crc_table[4][(v >> 24) & 0xff] ^
+			crc_table[3][(v >> 32) & 0xff] ^
+			crc_table[2][(v >> 40) & 0xff] ^
+			crc_table[1][(v >> 48) & 0xff] ^
+			crc_table[0][v >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_hw(unsigned int crc, const unsigned char *p,
+			      size_t len)
+{
+	unsigned long long crc64 = crc, v;
+
+	while (len >= 8) {
+		memcpy(&v, p, 8);
+		crc64 = __builtin_ia32_crc32di(crc64, v);
+		p += 8;
+		len -= 8;
+	}
+	crc = crc64;
+	while (len--)
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+	return crc;
+}
+
+static int have_crc32c_hw(void)
+{
+	return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+static unsigned int crc32c_hw(unsigned int crc, const unsigned char *p,
+			      size_t len)
+{
+	unsigned long v;
+
+	while (len >= 8) {
+		memcpy(&v, p, 8);
+		crc = __builtin_aarch64_crc32cx(crc, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = __builtin_aarch64_crc32cb(crc, *p++);
+	return crc;
+}
+
+static int have_crc32c_hw(void)
+{
+	return !!(getauxval(AT_HWCAP) & HWCAP_CRC32);
+}
+#else
+#define crc32c_hw	crc32c_sw
+
+static int have_crc32c_hw(void)
+{
+	return 0;
+}
+#endif
+
+unsigned int (*crc32c_update)(unsigned int, const unsigned char *,
+				     size_t);
+
+void crc32c_init(void)
+{
+	unsigned int crc;
+	int i, j;
+
+	for (i = 0; i < 256; ++i) {
+		crc = i;
+		for (j = 0; j < 8; ++j)
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+		crc_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; ++i)
+		for (j = 1; j < 8; ++j)
+			crc_table[j][i] = (crc_table[j - 1][i] >> 8) ^
+				crc_table[0][crc_table[j - 1][i] & 0xff];
+
+	crc32c_update = have_crc32c_hw() ? crc32c_hw : crc32c_sw;
+}
+
+int parse_size(const char *arg, unsigned long long *size)
+{
+	char *endptr;
+
+	errno = 0;
+	*size = strtoull(arg, &endptr, 0);
+	switch (*endptr) {
+	case 'G': case 'g':
+		*size <<= 10;
+		/* fall through */
+	case 'M': case 'm':
+		*size <<= 10;
+		/* fall through */
+	case 'K': case 'k':
+		*size <<= 10;
+		++endptr;
+		break;
+	}
+	if (errno || *endptr || endptr == arg) {
+		fprintf(stderr, "%s: Invalid size: %s\n", progname, arg);
+		return -1;
+	}
+	return 0;
+}
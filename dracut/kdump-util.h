@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2025 SUSE LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses>.
+ */
+
+/*
+ * Code shared by the dump writers in the kdump environment.
+ */
+
+#ifndef KDUMP_UTIL_H
+#define KDUMP_UTIL_H
+
+#include <stddef.h>
+
+/* CRC32C (Castagnoli) polynomial, bit-reflected */
+#define CRC32C_POLY	0x82f63b78U
+
+/* Name of the program in messages, defined by each program */
+extern const char *progname;
+
+/*
+ * Update a CRC32C with @len bytes at @p, with the CRC instruction of the
+ * CPU if it has one. Call crc32c_init() first.
+ */
+extern unsigned int (*crc32c_update)(unsigned int crc, const unsigned char *p,
+				     size_t len);
+void crc32c_init(void);
+
+/* Parse a size with an optional K, M or G suffix. */
+int parse_size(const char *arg, unsigned long long *size);
+
+#endif /* KDUMP_UTIL_H */
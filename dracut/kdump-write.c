@@ -0,0 +1,953 @@
+/*
+ * Copyright (c) 2025 SUSE LLC
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses>.
+ */
+
+/*
+ * Write a dump stream from a pipe to a file.
+ *
+ * The data is moved with splice(2), so it is never copied to user space.
+ * Space is preallocated ahead of the data, and written data is flushed
+ * and dropped from the page cache in windows, so the amount of dirty
+ * memory stays bounded in the small kdump environment.
+ *
+ * Optionally, a CRC32C digest of the data is computed on the fly, so the
+ * saved file can be verified later without reading it back in the kdump
+ * environment. The same program verifies a file against the digest.
+ *
+ * With more than one output, the stream is striped round-robin over the
+ * outputs in chunks of a fixed size, so it can be uploaded over several
+ * connections in parallel, or written to several disks. The --join mode
+ * puts the stripes together.
+ *
+ * In segment mode, the stream is cut into numbered files of a fixed size
+ * in a tmpfs, which can be uploaded and retried one by one.
+ *
+ * The copy can be limited to a given rate, so that a dump staged on a
+ * local disk can be uploaded in the background without saturating the
+ * network of a production system.
+ *
+ * With a free space limit, the copy stops as soon as the target file
+ * system gets below it, instead of filling the disk with a dump that
+ * would be deleted afterwards.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+
+#include "kdump-util.h"
+
+#define MiB		(1024UL * 1024UL)
+
+/* Default pipe buffer size */
+#define DEF_PIPE_SIZE	(1 * MiB)
+
+/* Default size of a write-back window */
+#define DEF_WINDOW	(64 * MiB)
+
+/* Maximum number of bytes moved by one splice(2) call */
+#define SPLICE_MAX	(1 * MiB)
+
+/* Default stripe size with multiple outputs */
+#define DEF_STRIPE	(4 * MiB)
+
+/* Seconds to wait for the reader of an output FIFO */
+#define OPEN_TIMEOUT	300
+
+/* Default number of segments that may exist at the same time */
+#define DEF_MAX_SEGMENTS	2
+
+/* Free space is checked whenever this much has been written */
+#define SPACE_CHECK	(16 * MiB)
+
+#define PIPE_MAX_SIZE	"/proc/sys/fs/pipe-max-size"
+
+const char *progname = "kdump-write";
+
+/* Write-back state of an output while another output is written */
+struct out_state {
+	unsigned long long pos, win_start, prev_start, prealloc;
+	unsigned long long space_checked;
+};
+
+struct writer {
+	int in, out;
+	const char *path;
+
+	int *outs;			/* all outputs when striping */
+	const char **paths;
+	struct out_state *states;
+	int nout, cur;
+	unsigned long long stripe;	/* stripe size */
+
+	unsigned long long total;	/* bytes written so far */
+	unsigned long long pos;		/* offset in the current output */
+	unsigned long long window;	/* write-back window size */
+	unsigned long long win_start;	/* start of the current window */
+	unsigned long long prev_start;	/* start of the previous window */
+	unsigned long long prealloc;	/* end of preallocated space */
+	int use_sync;			/* sync_file_range works */
+	int use_fallocate;		/* fallocate works */
+
+	unsigned long long limit;	/* stop after this many bytes */
+	unsigned long long rate;	/* bytes per second, 0 = unlimited */
+	struct timespec start;		/* start of the copy */
+	unsigned long long min_free;	/* stop below this free space */
+	unsigned long long space_checked; /* pos at the last check */
+
+	const char *digest;		/* where to store the digest */
+	int checksum;			/* compute the CRC32C */
+	unsigned int crc;		/* CRC32C of the data so far */
+	unsigned char *buf;		/* buffer for digest computation */
+	int tee_pipe[2];		/* copy of the data for the digest */
+};
+
+static int write_failure(const char *what, const char *path)
+{
+	fprintf(stderr, "%s: %s %s: %s\n", progname, what, path,
+		strerror(errno));
+	return -1;
+}
+
+/* Enlarge the pipe buffer, up to the system limit. */
+static void set_pipe_size(int fd, unsigned long long size)
+{
+	unsigned long long max;
+	FILE *f;
+
+	f = fopen(PIPE_MAX_SIZE, "r");
+	if (f) {
+		if (fscanf(f, "%llu", &max) == 1 && size > max)
+			size = max;
+		fclose(f);
+	}
+	/* not a pipe, or not permitted; it only costs performance */
+	fcntl(fd, F_SETPIPE_SZ, (int)size);
+}
+
+/* Keep preallocated space one window ahead of the data. */
+static void preallocate(struct writer *w)
+{
+	unsigned long long end = w->pos + w->window;
+
+	if (!w->use_fallocate || w->prealloc >= end)
+		return;
+
+	if (fallocate(w->out, 0, w->prealloc, end - w->prealloc) == 0)
+		w->prealloc = end;
+	else
+		w->use_fallocate = 0;
+}
+
+/*
+ * Start write-back of the current window, then wait for the previous
+ * window and drop it from the page cache.
+ */
+static int flush_window(struct writer *w, int last)
+{
+	unsigned long long len = w->pos - w->win_start;
+
+	if (!w->use_sync)
+		return 0;
+
+	if (len && sync_file_range(w->out, w->win_start, len,
+				   SYNC_FILE_RANGE_WRITE)) {
+		if (errno == EINVAL || errno == ESPIPE || errno == ENOSYS) {
+			w->use_sync = 0;
+			return 0;
+		}
+		return write_failure("Cannot write back", w->path);
+	}
+
+	if (w->win_start > w->prev_start) {
+		unsigned long long prev_len = w->win_start - w->prev_start;
+		if (sync_file_range(w->out, w->prev_start, prev_len,
+				    SYNC_FILE_RANGE_WAIT_BEFORE |
+				    SYNC_FILE_RANGE_WRITE |
+				    SYNC_FILE_RANGE_WAIT_AFTER))
+			return write_failure("Cannot write back", w->path);
+		posix_fadvise(w->out, w->prev_start, prev_len,
+			      POSIX_FADV_DONTNEED);
+	}
+
+	w->prev_start = w->win_start;
+	w->win_start = w->pos;
+
+	/* the rest is waited for by fdatasync() */
+	if (last)
+		posix_fadvise(w->out, w->prev_start, 0, POSIX_FADV_DONTNEED);
+	return 0;
+}
+
+/* Fallback if splice(2) is not possible between the two files. */
+static ssize_t copy_data(struct writer *w, size_t max)
+{
+	static char buf[256 * 1024];
+	ssize_t len, done, ret;
+
+	if (max > sizeof(buf))
+		max = sizeof(buf);
+	do {
+		len = read(w->in, buf, max);
+	} while (len < 0 && errno == EINTR);
+	if (len <= 0)
+		return len;
+	if (w->checksum)
+		w->crc = crc32c_update(w->crc, (unsigned char *)buf, len);
+
+	for (done = 0; done < len; done += ret) {
+		ret = write(w->out, buf + done, len - done);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				ret = 0;
+				continue;
+			}
+			return -1;
+		}
+	}
+	return len;
+}
+
+/*
+ * Duplicate the data in the input pipe with tee(2) and read the copy for
+ * the digest, then splice the original to the output.
+ */
+static ssize_t splice_digest(struct writer *w, size_t max)
+{
+	ssize_t len, done, ret;
+
+	len = tee(w->in, w->tee_pipe[1], max, 0);
+	if (len <= 0)
+		return len;
+
+	for (done = 0; done < len; done += ret) {
+		ret = read(w->tee_pipe[0], w->buf + done, len - done);
+		if (ret < 0 && errno == EINTR)
+			ret = 0;
+		else if (ret <= 0)
+			return -1;
+	}
+	w->crc = crc32c_update(w->crc, w->buf, len);
+
+	for (done = 0; done < len; done += ret) {
+		ret = splice(w->in, NULL, w->out, NULL, len - done,
+			     SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (ret < 0 && errno == EINTR)
+			ret = 0;
+		else if (ret <= 0)
+			return -1;
+	}
+	return len;
+}
+
+/* Make output @n the current one, keeping the state of the previous. */
+static void switch_output(struct writer *w, int n)
+{
+	struct out_state *s = &w->states[w->cur];
+
+	s->pos = w->pos;
+	s->win_start = w->win_start;
+	s->prev_start = w->prev_start;
+	s->prealloc = w->prealloc;
+	s->space_checked = w->space_checked;
+
+	s = &w->states[n];
+	w->pos = s->pos;
+	w->win_start = s->win_start;
+	w->prev_start = s->prev_start;
+	w->prealloc = s->prealloc;
+	w->space_checked = s->space_checked;
+	w->out = w->outs[n];
+	w->path = w->paths[n];
+	w->cur = n;
+}
+
+/* Select the output for the current position in the stream. */
+static size_t next_output(struct writer *w)
+{
+	unsigned long long pos;
+	int n;
+
+	if (w->nout <= 1)
+		return SPLICE_MAX;
+
+	pos = w->total % w->stripe;
+	n = (w->total / w->stripe) % w->nout;
+	if (n != w->cur)
+		switch_output(w, n);
+	return w->stripe - pos < SPLICE_MAX ? w->stripe - pos : SPLICE_MAX;
+}
+
+static double elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Sleep until the data written so far is within the rate limit. */
+static void throttle(struct writer *w)
+{
+	struct timespec ts;
+	double ahead;
+
+	if (!w->rate)
+		return;
+	ahead = (double)w->total / w->rate - elapsed(&w->start);
+	if (ahead <= 0)
+		return;
+	ts.tv_sec = ahead;
+	ts.tv_nsec = (ahead - ts.tv_sec) * 1e9;
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+/*
+ * Stop before the file system has less than min_free bytes available.
+ * Space that is preallocated but not written yet still counts as free.
+ */
+static int check_space(struct writer *w)
+{
+	unsigned long long avail;
+	struct statvfs st;
+
+	if (!w->min_free || (w->pos && w->pos - w->space_checked < SPACE_CHECK))
+		return 0;
+	w->space_checked = w->pos;
+	if (fstatvfs(w->out, &st))
+		return 0;
+	avail = (unsigned long long)st.f_bavail * st.f_frsize;
+	if (w->prealloc > w->pos)
+		avail += w->prealloc - w->pos;
+	if (avail >= w->min_free)
+		return 0;
+
+	fprintf(stderr, "%s: %s: Less than %llu MiB free, stopped after "
+		"%llu bytes\n", progname, w->path, w->min_free / MiB, w->total);
+	/* give back the preallocated space */
+	if (w->prealloc > w->pos && ftruncate(w->out, w->pos))
+		write_failure("Cannot truncate", w->path);
+	return -1;
+}
+
+static int write_stream(struct writer *w)
+{
+	int use_splice = 1, i;
+	size_t max;
+	ssize_t len;
+
+	for (;;) {
+		max = next_output(w);
+		if (check_space(w))
+			return -1;
+		preallocate(w);
+		if (w->limit && w->limit - w->total < max)
+			max = w->limit - w->total;
+		if (!max)
+			break;
+
+		if (use_splice) {
+			if (w->checksum)
+				len = splice_digest(w, max);
+			else
+				len = splice(w->in, NULL, w->out, NULL, max,
+					     SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (len < 0 && errno == EINTR)
+				continue;
+			if (len < 0 && errno == EINVAL && !w->total) {
+				use_splice = 0;
+				continue;
+			}
+		} else
+			len = copy_data(w, max);
+
+		if (len < 0)
+			return write_failure("Cannot write", w->path);
+		if (len == 0)
+			break;
+
+		w->total += len;
+		w->pos += len;
+		if (w->pos - w->win_start >= w->window &&
+		    flush_window(w, 0))
+			return -1;
+		throttle(w);
+	}
+
+	for (i = 0; i < (w->nout > 1 ? w->nout : 1); ++i) {
+		if (w->nout > 1)
+			switch_output(w, i);
+		if (flush_window(w, 1))
+			return -1;
+
+		/* release preallocated space after the end of data */
+		if (w->prealloc > w->pos && ftruncate(w->out, w->pos))
+			return write_failure("Cannot truncate", w->path);
+
+		if (fdatasync(w->out) && errno != EINVAL)
+			return write_failure("Cannot sync", w->path);
+	}
+	return 0;
+}
+
+static int init_digest(struct writer *w)
+{
+	w->checksum = 1;
+	crc32c_init();
+	w->crc = ~0U;
+	w->buf = malloc(SPLICE_MAX);
+	if (!w->buf) {
+		fprintf(stderr, "%s: Cannot allocate buffer\n", progname);
+		return -1;
+	}
+	if (pipe2(w->tee_pipe, O_CLOEXEC))
+		return write_failure("Cannot create", "pipe");
+	fcntl(w->tee_pipe[1], F_SETPIPE_SZ, SPLICE_MAX);
+	return 0;
+}
+
+/* The digest file contains the algorithm, the CRC and the size. */
+static int write_digest(struct writer *w)
+{
+	FILE *f;
+
+	f = fopen(w->digest, "w");
+	if (!f)
+		return write_failure("Cannot create", w->digest);
+	fprintf(f, "crc32c %08x %llu\n", ~w->crc, w->total);
+	if (fclose(f))
+		return write_failure("Cannot write", w->digest);
+	return 0;
+}
+
+static void segment_path(char *path, const char *prefix, unsigned long n)
+{
+	snprintf(path, PATH_MAX, "%s.%06lu", prefix, n);
+}
+
+/*
+ * Write the stream in numbered segments <prefix>.NNNNNN. A segment gets
+ * its name when it is complete, and the uploader removes it when it has
+ * been saved. At most max_segs segments exist at a time, so the memory
+ * used in a tmpfs stays bounded.
+ *
+ * Each segment is listed with its size and CRC32C in <prefix>.manifest,
+ * which is created when the stream ends. If <prefix>.abort appears, an
+ * upload has failed for good, and writing stops.
+ */
+static int write_segments(struct writer *w, const char *prefix,
+			  unsigned long long segsize, unsigned long max_segs)
+{
+	char path[PATH_MAX], part[PATH_MAX + 8], manifest[PATH_MAX];
+	char abort_path[PATH_MAX];
+	unsigned long n, oldest = 0;
+	unsigned long long total = 0;
+	const char *name;
+	FILE *mf;
+
+	name = strrchr(prefix, '/');
+	name = name ? name + 1 : prefix;
+	snprintf(manifest, sizeof(manifest), "%s.manifest.part", prefix);
+	snprintf(abort_path, sizeof(abort_path), "%s.abort", prefix);
+
+	mf = fopen(manifest, "w");
+	if (!mf)
+		return write_failure("Cannot create", manifest);
+	fprintf(mf, "segment-size %llu\n", segsize);
+
+	for (n = 0; ; ++n) {
+		/* wait until the uploads make room */
+		while (n - oldest >= max_segs) {
+			segment_path(path, prefix, oldest);
+			if (access(path, F_OK)) {
+				++oldest;
+				continue;
+			}
+			if (!access(abort_path, F_OK)) {
+				fprintf(stderr, "%s: upload of %s failed, "
+					"giving up\n", progname, prefix);
+				fclose(mf);
+				return -1;
+			}
+			usleep(100000);
+		}
+
+		segment_path(path, prefix, n);
+		snprintf(part, sizeof(part), "%s.part", path);
+		w->out = open(part, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (w->out < 0) {
+			fclose(mf);
+			return write_failure("Cannot create", part);
+		}
+		w->path = part;
+		w->total = 0;
+		w->pos = 0;
+		w->crc = ~0U;
+		clock_gettime(CLOCK_MONOTONIC, &w->start);
+		if (write_stream(w)) {
+			fclose(mf);
+			return -1;
+		}
+		close(w->out);
+
+		if (!w->total) {
+			unlink(part);
+			break;
+		}
+		if (rename(part, path)) {
+			fclose(mf);
+			return write_failure("Cannot rename", part);
+		}
+		fprintf(mf, "%s.%06lu %llu %08x\n", name, n, w->total, ~w->crc);
+		total += w->total;
+		if (w->total < segsize) {
+			++n;
+			break;
+		}
+	}
+
+	fprintf(mf, "total %lu %llu\n", n, total);
+	if (fclose(mf))
+		return write_failure("Cannot write", manifest);
+	snprintf(path, sizeof(path), "%s.manifest", prefix);
+	if (rename(manifest, path))
+		return write_failure("Cannot rename", manifest);
+
+	w->total = total;
+	w->path = prefix;
+	return 0;
+}
+
+/* Read a saved file and compare it with a digest. */
+static int verify(const char *path, const char *crcstr, const char *sizestr)
+{
+	static unsigned char buf[1024 * 1024];
+	unsigned long long size = 0, expect_size;
+	unsigned int crc = ~0U, expect_crc;
+	char *endptr;
+	ssize_t len;
+	int fd;
+
+	expect_crc = strtoul(crcstr, &endptr, 16);
+	if (*endptr || endptr == crcstr) {
+		fprintf(stderr, "%s: Invalid CRC32C: %s\n", progname, crcstr);
+		return 2;
+	}
+	if (parse_size(sizestr, &expect_size))
+		return 2;
+
+	crc32c_init();
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		write_failure("Cannot open", path);
+		return 1;
+	}
+	/* read from the storage, e.g. an NFS server, not the page cache */
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	while ((len = read(fd, buf, sizeof(buf))) != 0) {
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			write_failure("Cannot read", path);
+			close(fd);
+			return 1;
+		}
+		crc = crc32c_update(crc, buf, len);
+		size += len;
+	}
+	close(fd);
+	crc = ~crc;
+
+	if (size != expect_size) {
+		printf("%s: FAILED (size %llu, expected %llu)\n",
+		       path, size, expect_size);
+		return 1;
+	}
+	if (crc != expect_crc) {
+		printf("%s: FAILED (crc32c %08x, expected %08x)\n",
+		       path, crc, expect_crc);
+		return 1;
+	}
+	printf("%s: OK\n", path);
+	return 0;
+}
+
+/*
+ * Open all outputs. The reader of a FIFO may be an upload that fails
+ * before it opens the FIFO, so do not wait for it forever. The FIFOs are
+ * opened as their readers appear; if one does not, exiting closes the
+ * others, and their readers see the end of data instead of hanging.
+ */
+static int open_outputs(struct writer *w)
+{
+	int i, pending, tries = OPEN_TIMEOUT * 10;
+	struct stat st;
+
+	for (i = 0, pending = 0; i < w->nout; ++i) {
+		if (!strcmp(w->paths[i], "-")) {
+			w->paths[i] = "<stdout>";
+			w->outs[i] = STDOUT_FILENO;
+		} else if (!stat(w->paths[i], &st) && S_ISFIFO(st.st_mode)) {
+			w->outs[i] = -1;
+			++pending;
+		} else {
+			w->outs[i] = open(w->paths[i],
+					  O_WRONLY | O_CREAT | O_TRUNC, 0600);
+			if (w->outs[i] < 0)
+				return write_failure("Cannot create",
+						     w->paths[i]);
+		}
+	}
+
+	while (pending) {
+		for (i = 0; i < w->nout; ++i) {
+			int fd;
+
+			if (w->outs[i] >= 0)
+				continue;
+			fd = open(w->paths[i], O_WRONLY | O_NONBLOCK);
+			if (fd < 0 && (errno != ENXIO || !tries))
+				return write_failure("Cannot open",
+						     w->paths[i]);
+			if (fd >= 0) {
+				fcntl(fd, F_SETFL,
+				      fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+				w->outs[i] = fd;
+				--pending;
+			}
+		}
+		if (pending && tries--)
+			usleep(100000);
+	}
+	return 0;
+}
+
+/*
+ * Copy up to len bytes from in to out; less is copied only at the end
+ * of the input.
+ */
+static long long copy_range(int in, int out, unsigned long long len)
+{
+	static char buf[256 * 1024];
+	unsigned long long done = 0;
+	ssize_t ret, wret, off;
+	static int use_cfr = 1;
+
+	while (done < len) {
+		if (use_cfr) {
+			ret = copy_file_range(in, NULL, out, NULL,
+					      len - done, 0);
+			if (ret < 0 && (errno == EXDEV || errno == EINVAL ||
+					errno == ENOSYS || errno == EOPNOTSUPP)) {
+				use_cfr = 0;
+				continue;
+			}
+		} else {
+			ret = read(in, buf, len - done < sizeof(buf) ?
+				   len - done : sizeof(buf));
+			for (off = 0; ret > 0 && off < ret; off += wret) {
+				wret = write(out, buf + off, ret - off);
+				if (wret < 0)
+					return -1;
+			}
+		}
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+	return done;
+}
+
+/*
+ * Put the stripes written with multiple outputs back together. Only the
+ * last stripe may be short; all following inputs must be empty.
+ */
+static int join_stripes(const char *path, char **inputs, int n,
+			unsigned long long stripe)
+{
+	unsigned long long total = 0;
+	int *fds, out, i, ret = 1;
+	long long len;
+	char dummy;
+
+	fds = calloc(n, sizeof(int));
+	if (!fds) {
+		fprintf(stderr, "%s: Cannot allocate buffer\n", progname);
+		return 1;
+	}
+	for (i = 0; i < n; ++i) {
+		fds[i] = open(inputs[i], O_RDONLY);
+		if (fds[i] < 0) {
+			write_failure("Cannot open", inputs[i]);
+			return 1;
+		}
+		posix_fadvise(fds[i], 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+	out = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (out < 0) {
+		write_failure("Cannot create", path);
+		return 1;
+	}
+
+	for (i = 0; ; i = (i + 1) % n) {
+		len = copy_range(fds[i], out, stripe);
+		if (len < 0) {
+			write_failure("Cannot copy", inputs[i]);
+			goto out;
+		}
+		total += len;
+		if ((unsigned long long)len < stripe)
+			break;
+	}
+
+	/* everything after a short stripe must be at EOF */
+	for (i = 0; i < n; ++i) {
+		if (read(fds[i], &dummy, 1) != 0) {
+			fprintf(stderr, "%s: %s: unexpected data after the "
+				"end of the stripe set\n", progname, inputs[i]);
+			goto out;
+		}
+	}
+	ret = 0;
+	printf("%s: %llu bytes from %d files\n", path, total, n);
+out:
+	if (close(out) && !ret)
+		ret = -write_failure("Cannot close", path);
+	return ret;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [options] <input> <output>...\n"
+		"       %s --verify <file> <crc32c> <size>\n"
+		"       %s --join [-s SIZE] <output> <stripe>...\n"
+		"       %s --segment-size=SIZE [options] <input> <prefix>\n"
+		"\n"
+		"Copy <input> (a pipe or FIFO, - for stdin) to <output>\n"
+		"(- for stdout), or verify a saved file. With more than one\n"
+		"output, the data is striped over the outputs. With segments,\n"
+		"it is cut into files <prefix>.NNNNNN and <prefix>.manifest.\n"
+		"\n"
+		"Options:\n"
+		"  -d, --digest=FILE       store the CRC32C and size of the data\n"
+		"  -p, --pipe-size=SIZE    enlarge the input pipe (default 1M)\n"
+		"  -s, --stripe-size=SIZE  stripe size (default 4M)\n"
+		"  -w, --window=SIZE       write-back window (default 64M)\n"
+		"  -r, --rate=SIZE         copy at most SIZE bytes per second\n"
+		"  -f, --min-free=SIZE     stop if less than SIZE remains free\n"
+		"  -q, --quiet             do not report the throughput\n"
+		"  -V, --verify            verify <file> against a digest\n"
+		"  -j, --join              join stripes into <output>\n"
+		"  -S, --segment-size=SIZE write segments of SIZE\n"
+		"  -m, --max-segments=N    segments existing at a time (default 2)\n",
+		progname, progname, progname, progname);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "digest", 1, 0, 'd' },
+		{ "pipe-size", 1, 0, 'p' },
+		{ "stripe-size", 1, 0, 's' },
+		{ "window", 1, 0, 'w' },
+		{ "rate", 1, 0, 'r' },
+		{ "min-free", 1, 0, 'f' },
+		{ "quiet", 0, 0, 'q' },
+		{ "verify", 0, 0, 'V' },
+		{ "join", 0, 0, 'j' },
+		{ "segment-size", 1, 0, 'S' },
+		{ "max-segments", 1, 0, 'm' },
+		{ "help", 0, 0, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+	struct writer w = {
+		.window = DEF_WINDOW,
+		.use_sync = 1,
+		.use_fallocate = 1,
+		.stripe = DEF_STRIPE,
+	};
+	unsigned long long pipe_size = DEF_PIPE_SIZE;
+	unsigned long long segsize = 0, max_segs = DEF_MAX_SEGMENTS;
+	struct timespec start;
+	int quiet = 0, do_verify = 0, do_join = 0;
+	double secs;
+	int c, i, ret;
+
+	while ((c = getopt_long(argc, argv, "d:p:s:w:r:f:qVjS:m:h", opts, NULL)) != -1) {
+		switch (c) {
+		case 'd':
+			w.digest = optarg;
+			break;
+		case 'p':
+			if (parse_size(optarg, &pipe_size))
+				return 2;
+			break;
+		case 's':
+			if (parse_size(optarg, &w.stripe))
+				return 2;
+			break;
+		case 'w':
+			if (parse_size(optarg, &w.window))
+				return 2;
+			break;
+		case 'r':
+			if (parse_size(optarg, &w.rate))
+				return 2;
+			break;
+		case 'f':
+			if (parse_size(optarg, &w.min_free))
+				return 2;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'V':
+			do_verify = 1;
+			break;
+		case 'j':
+			do_join = 1;
+			break;
+		case 'S':
+			if (parse_size(optarg, &segsize))
+				return 2;
+			break;
+		case 'm':
+			if (parse_size(optarg, &max_segs))
+				return 2;
+			break;
+		case 'h':
+			usage();
+			return 0;
+		default:
+			usage();
+			return 2;
+		}
+	}
+	if (do_verify) {
+		if (argc - optind != 3) {
+			usage();
+			return 2;
+		}
+		return verify(argv[optind], argv[optind + 1], argv[optind + 2]);
+	}
+	if (do_join) {
+		if (argc - optind < 2 || !w.stripe) {
+			usage();
+			return 2;
+		}
+		return join_stripes(argv[optind], argv + optind + 1,
+				    argc - optind - 1, w.stripe);
+	}
+	if (argc - optind < 2 || !w.window || !w.stripe ||
+	    (segsize && (argc - optind != 2 || !max_segs || w.digest))) {
+		usage();
+		return 2;
+	}
+	if (w.digest && init_digest(&w))
+		return 1;
+
+	if (strcmp(argv[optind], "-")) {
+		w.in = open(argv[optind], O_RDONLY);
+		if (w.in < 0)
+			return -write_failure("Cannot open", argv[optind]);
+	} else
+		w.in = STDIN_FILENO;
+	set_pipe_size(w.in, pipe_size);
+
+	if (segsize) {
+		/* segments are kept in memory until they are uploaded */
+		w.use_sync = 0;
+		w.use_fallocate = 0;
+		w.limit = segsize;
+		if (init_digest(&w))
+			return 1;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		w.start = start;
+		if (write_segments(&w, argv[optind + 1], segsize, max_segs))
+			return 1;
+		goto report;
+	}
+
+	w.nout = argc - optind - 1;
+	w.paths = (const char **)argv + optind + 1;
+	w.outs = calloc(w.nout, sizeof(int));
+	w.states = calloc(w.nout, sizeof(struct out_state));
+	if (!w.outs || !w.states) {
+		fprintf(stderr, "%s: Cannot allocate buffer\n", progname);
+		return 1;
+	}
+	if (open_outputs(&w))
+		return 1;
+	for (i = 0; w.nout > 1 && i < w.nout; ++i)
+		set_pipe_size(w.outs[i], pipe_size);
+	w.out = w.outs[0];
+	w.path = w.paths[0];
+	if (w.nout > 1) {
+		struct stat st;
+
+		/* stripes to uploads do not go to the page cache */
+		for (i = 0; i < w.nout; ++i)
+			if (fstat(w.outs[i], &st) || !S_ISREG(st.st_mode)) {
+				w.use_sync = 0;
+				w.use_fallocate = 0;
+			}
+		/* files on several disks share the dirty memory */
+		w.window /= w.nout;
+		if (w.window < w.stripe)
+			w.window = w.stripe;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	w.start = start;
+	ret = write_stream(&w);
+	for (i = 0; i < w.nout; ++i)
+		if (close(w.outs[i]) && !ret)
+			ret = write_failure("Cannot close", w.paths[i]);
+	if (w.nout > 1)
+		w.path = argv[optind];
+	if (!ret && w.digest)
+		ret = write_digest(&w);
+	if (ret)
+		return 1;
+
+report:
+	secs = elapsed(&start);
+	if (!quiet)
+		fprintf(stderr, "%s: %llu bytes in %.1f s (%.1f MiB/s)\n",
+			w.path, w.total, secs,
+			secs > 0 ? w.total / secs / MiB : 0.0);
+	return 0;
+}
@@ -30,8 +30,9 @@ check() {
 		# always set up network
 		kdump_neednet=y
 	else
-		# everything other than "file" needs network
-		[[ ${KDUMP_PROTO} == file ]] || kdump_neednet=y
+		# everything other than "file" needs network,
+		# unless the dump is staged on a local disk
+		[[ ${KDUMP_PROTO} == file ]] || [[ -n ${KDUMP_STAGING_DIR} ]] || kdump_neednet=y
 	fi
 
 	return 0
@@ -163,21 +164,30 @@ install() {
 		"$initdir/var/lib/dracut/hooks/cmdline/00-parse-root.sh"
 
 	inst_script "$moddir"/kdump-save /kdump/kdump-save
+	inst_binary "$moddir"/kdump-write /kdump/kdump-write
 	inst_simple "$moddir/kdump-save.service" "$systemdsystemunitdir/kdump-save.service"
 
 	mkdir -p "$initdir/$systemdsystemunitdir"/initrd.target.wants
 	ln_r "$systemdsystemunitdir"/kdump-save.service \
 		"$systemdsystemunitdir"/initrd.target.wants/kdump-save.service
 
+	# a remote dump is staged on a local disk and uploaded after reboot
+	local _proto=${KDUMP_PROTO}
+	if [[ -n ${KDUMP_STAGING_DIR} ]] && [[ ${KDUMP_PROTO} != file ]]; then
+		_proto=file
+		KDUMP_SAVEDIR=${KDUMP_STAGING_DIR}
+		echo "KDUMP_PROTO=file" >> ${initdir}/etc/kdump.conf
+	fi
+
 	# per-protocol config
-	case ${KDUMP_PROTO} in
+	case ${_proto} in
 		ssh)
 			if ! inst_multiple ssh; then
 				dfatal "Kdump needs ssh for ${KDUMP_SAVEDIR}."
 				exit 1
 			fi
 
-			[[ ${KDUMP_NET_TIMEOUT} -gt 0 ]] && inst_multiple ping
+			[[ ${KDUMP_NET_TIMEOUT} -gt 0 ]] && inst_binary "$moddir"/kdump-netwait /kdump/kdump-netwait
 			kdump_init_ssh
 			;;
 		ftp)
@@ -185,27 +195,46 @@ install() {
 				dfatal "Kdump needs lftp for ${KDUMP_SAVEDIR}."
 				exit 1
 			fi
-			[[ ${KDUMP_NET_TIMEOUT} -gt 0 ]] && inst_multiple ping
+			[[ ${KDUMP_NET_TIMEOUT} -gt 0 ]] && inst_binary "$moddir"/kdump-netwait /kdump/kdump-netwait
 			;;
 		sftp)
 			if ! inst_multiple lftp /usr/lib64/lftp/*/proto-sftp.so ssh; then
 				dfatal "Kdump needs lftp and ssh for ${KDUMP_SAVEDIR}."
 				exit 1
 			fi
-			[[ ${KDUMP_NET_TIMEOUT} -gt 0 ]] && inst_multiple ping
+			[[ ${KDUMP_NET_TIMEOUT} -gt 0 ]] && inst_binary "$moddir"/kdump-netwait /kdump/kdump-netwait
 			kdump_init_ssh
 			;;
 		file)
-			[[ ${KDUMP_FREE_DISK_SIZE} -gt 0 ]] && inst_multiple df
+			[[ ${KDUMP_FREE_DISK_SIZE} -gt 0 ]] && inst_multiple df stat
 			
 			# dereference symlinks, because they might not work in the
 			# kdump environment when the directory is mounted elsewhere
 			KDUMP_SAVEDIR_REALPATH=$(realpath -m "${KDUMP_SAVEDIR#*://}")
 			echo "KDUMP_SAVEDIR='${KDUMP_SAVEDIR_REALPATH//\'/\'\\\'\'}'" >> ${initdir}/etc/kdump.conf
+
+			# the same for the parts of a split vmcore
+			local _d _split=""
+			if [[ ${KDUMP_PROTO} == file ]]; then
+				for _d in ${KDUMP_SPLIT_DIRS}; do
+					_split+=" $(realpath -m "${_d#*://}")"
+				done
+			fi
+			echo "KDUMP_SPLIT_DIRS='${_split# }'" >> ${initdir}/etc/kdump.conf
 			;;
 	esac
 
 	inst_multiple makedumpfile date sleep $KDUMP_REQUIRED_PROGRAMS
+
+	[[ ${KDUMP_DUMPFORMAT} == ELF ]] && inst_binary "$moddir"/kdump-elfdump /kdump/kdump-elfdump
+
+	if [[ ${KDUMP_DUMPFORMAT} == raw-zstd ]]; then
+		if [[ -x "$moddir"/kdump-rawdump ]]; then
+			inst_binary "$moddir"/kdump-rawdump /kdump/kdump-rawdump
+		else
+			dwarn "kdump-rawdump not available, KDUMP_DUMPFORMAT=raw-zstd saves an uncompressed vmcore"
+		fi
+	fi
 	
 	if [ "$kdump_neednet" = y ]; then
 		# Install /etc/resolv.conf to provide initial DNS configuration. The file
@@ -267,6 +296,36 @@ function kdump_init_ssh()						   # {{{
 		echo "IdentityFile /root/.ssh/${f}" >> "${SSH_DIR}/config"
 	done
 	popd >/dev/null
+
+	# all transfers of a vmcore stream share one connection, which
+	# kdump-save opens; KDUMP_SSH_STREAM is the number of the stream
+	echo 'ControlPath /tmp/ssh-kdump.${KDUMP_SSH_STREAM}' >> "${SSH_DIR}/config"
+
+	# transport tuning: AES-GCM is fastest with AES instructions in the
+	# CPU, ChaCha20 without them; the dump is compressed by makedumpfile
+	local _ciphers="chacha20-poly1305@openssh.com,aes128-gcm@openssh.com,aes256-gcm@openssh.com"
+	kdump_cpu_has_aes && _ciphers="aes128-gcm@openssh.com,aes256-gcm@openssh.com,chacha20-poly1305@openssh.com"
+	echo "Ciphers ${_ciphers},aes128-ctr,aes192-ctr,aes256-ctr" >> "${SSH_DIR}/config"
+	echo "Compression no" >> "${SSH_DIR}/config"
+	echo "IPQoS throughput" >> "${SSH_DIR}/config"
+	dinfo "kdump: ssh ciphers ${_ciphers}"
+}
+
+# check if the CPU has instructions for AES
+function kdump_cpu_has_aes()
+{
+	case $(uname -m) in
+		s390x)
+			# CPACF
+			return 0
+			;;
+		ppc64*)
+			LD_SHOW_AUXV=1 /bin/true | grep -qw vcrypto
+			;;
+		*)
+			grep -qw aes /proc/cpuinfo
+			;;
+	esac
 }
 
 # mimic the logic of kdump-save determining if an interactive shell may be run
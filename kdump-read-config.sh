@@ -12,6 +12,7 @@ function kdump_read_config_main()
 	option bool 	 KDUMP_CONTINUE_ON_ERROR true
 	option int 	 KDUMP_CPUS 32
 	option string	 KDUMP_CRASHKERNEL "auto"
+	option int 	 KDUMP_DEADLINE 0
 	option string 	 KDUMP_DUMPFORMAT "compressed"
 	option int 	 KDUMP_DUMPLEVEL 31
 	option bool 	 KDUMP_FADUMP false
@@ -19,10 +20,13 @@ function kdump_read_config_main()
 	option string 	 FADUMP_COMMANDLINE_APPEND "numa=off cgroup_disable=memory cma=0 kvm_cma_resv_ratio=0 hugetlb_cma=0 transparent_hugepage=never novmcoredd udev.children-max=2"
 	option int 	 KDUMP_FREE_DISK_SIZE 64
 	option string 	 KDUMP_HOST_KEY ""
+	option int 	 KDUMP_HOTPLUG_DELAY 5
 	option bool 	 KDUMP_IMMEDIATE_REBOOT true
 	option int 	 KDUMP_KEEP_OLD_DUMPS 0
 	option string 	 KDUMP_KERNELVER ""
 	option string 	 KDUMP_NETCONFIG "auto"
+	option int 	 KDUMP_NET_SEGMENT_SIZE 0
+	option int 	 KDUMP_NET_STREAMS 1
 	option int 	 KDUMP_NET_TIMEOUT 30
 	option string 	 KDUMP_NOTIFICATION_CC ""
 	option string 	 KDUMP_NOTIFICATION_TO ""
@@ -33,8 +37,12 @@ function kdump_read_config_main()
 	option string 	 KDUMP_SMTP_PASSWORD ""
 	option string 	 KDUMP_SMTP_SERVER ""
 	option string 	 KDUMP_SMTP_USER ""
+	option string 	 KDUMP_SPLIT_DIRS ""
 	option string 	 KDUMP_SSH_IDENTITY ""
+	option string 	 KDUMP_STAGING_DIR ""
 	option string 	 KDUMP_TRANSFER ""
+	option string 	 KDUMP_TRIAGE "no"
+	option int 	 KDUMP_UPLOAD_RATE 0
 	option int 	 KDUMP_VERBOSE 0
 	option string 	 KEXEC_OPTIONS ""
 	option string 	 MAKEDUMPFILE_OPTIONS ""
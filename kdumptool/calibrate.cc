@@ -38,11 +38,16 @@
 
 
 bool needsNetwork;
+bool needsNetStreams;
 bool needsMakedumpfile;
+bool needsRawdump;
+bool needsElfdump;
 long long KDUMP_CPUS, KDUMP_LUKS_MEMORY;
+long long KDUMP_NET_STREAMS = 1, KDUMP_NET_SEGMENT_SIZE;
 char *kernel_version = NULL;
 bool m_shrink = false;
 bool debug = false;
+const char *iomem_path = "/proc/iomem";
 
 void read_str(std::string &str, const char* path);
 
@@ -152,11 +157,17 @@ static inline unsigned long s390x_align_memmap(unsigned long maxpfn)
 // Assuming that sizeof(void*) == sizeof(long):
 #define KERNEL_HASH_PER_MB	(232*sizeof(long))
 
-// Estimated buffer metadata and filesystem in KiB per dirty MiB
-#define BUF_PER_DIRTY_MB	64
+// Estimated buffer metadata and filesystem in KiB per dirty MiB,
+// unless measured (BUF_PER_DIRTY_MB in calibrate.conf)
+#define DEF_BUF_PER_DIRTY_MB	64
 
-// Default vm dirty ratio is 20%
-#define DIRTY_RATIO		20
+// Default vm dirty ratio is 20%, unless set (DIRTY_RATIO in calibrate.conf)
+#define DEF_DIRTY_RATIO		20
+
+// Estimated user space for each upload stream after the first, which
+// USER_NET includes: an ssh or lftp client, an ssh ControlMaster and
+// the pipes between them and the kdump-write striper
+#define NET_STREAM_KB		(6*1024)
 
 // Reserve this much percent above the calculated value
 #define ADD_RESERVE_PCT		30
@@ -193,6 +204,8 @@ class SizeConstants {
         unsigned long m_sizeof_page;
         unsigned long m_user_base;
         unsigned long m_user_net;
+        unsigned long m_dirty_ratio;
+        unsigned long m_buf_per_dirty_mb;
 
     public:
         SizeConstants(void);
@@ -279,6 +292,20 @@ class SizeConstants {
          */
         unsigned long user_net_kb(void) const
         { return m_user_net; }
+
+        /** Get the maximum dirty and writeback pages.
+         *
+         * @returns dirty pages in percent of total memory
+         */
+        unsigned long dirty_ratio(void) const
+        { return m_dirty_ratio; }
+
+        /** Get the in-flight I/O memory (buffers, slab) per dirty MiB.
+         *
+         * @returns in-flight I/O requirements per dirty MiB [KiB]
+         */
+        unsigned long buf_per_dirty_mb(void) const
+        { return m_buf_per_dirty_mb; }
 };
 
 // -----------------------------------------------------------------------------
@@ -287,18 +314,22 @@ SizeConstants::SizeConstants(void)
     static const struct {
         const char *const name;
         unsigned long SizeConstants::*const var;
+        long def;       // default if not measured, or -1 if required
     } vars[] = {
-        { "KERNEL_BASE", &SizeConstants::m_kernel_base },
-        { "KERNEL_INIT", &SizeConstants::m_kernel_init },
-        { "INIT_NET", &SizeConstants::m_kernel_init_net },
-        { "INIT_CACHED", &SizeConstants::m_init_cached },
-        { "INIT_CACHED_NET", &SizeConstants::m_init_cached_net },
-        { "PERCPU", &SizeConstants::m_percpu },
-        { "PAGESIZE", &SizeConstants::m_pagesize },
-        { "SIZEOFPAGE", &SizeConstants::m_sizeof_page },
-        { "USER_BASE", &SizeConstants::m_user_base },
-        { "USER_NET", &SizeConstants::m_user_net },
-        { nullptr, nullptr }
+        { "KERNEL_BASE", &SizeConstants::m_kernel_base, -1 },
+        { "KERNEL_INIT", &SizeConstants::m_kernel_init, -1 },
+        { "INIT_NET", &SizeConstants::m_kernel_init_net, -1 },
+        { "INIT_CACHED", &SizeConstants::m_init_cached, -1 },
+        { "INIT_CACHED_NET", &SizeConstants::m_init_cached_net, -1 },
+        { "PERCPU", &SizeConstants::m_percpu, -1 },
+        { "PAGESIZE", &SizeConstants::m_pagesize, -1 },
+        { "SIZEOFPAGE", &SizeConstants::m_sizeof_page, -1 },
+        { "USER_BASE", &SizeConstants::m_user_base, -1 },
+        { "USER_NET", &SizeConstants::m_user_net, -1 },
+        { "DIRTY_RATIO", &SizeConstants::m_dirty_ratio, DEF_DIRTY_RATIO },
+        { "BUF_PER_DIRTY_MB", &SizeConstants::m_buf_per_dirty_mb,
+          DEF_BUF_PER_DIRTY_MB },
+        { nullptr, nullptr, 0 }
     };
     /* get the kernel flavour from KDUMP_KERNEL_VERSION or uname;
        if not default, try looking for the flavour-suffixed variable,
@@ -335,12 +366,21 @@ SizeConstants::SizeConstants(void)
 	if (!val || !*val)
 	    val = std::getenv(p->name);
 
+        if ((!val || !*val) && p->def >= 0) {
+            DEBUG("No value configured for %s, using %ld", p->name, p->def);
+            this->*p->var = p->def;
+            continue;
+        }
         if (!val || !*val)
             throw std::runtime_error(std::string("No value configured for ") + p->name);
         this->*p->var = strtoll(val, &end, 10);
 		if (*end)
             throw std::runtime_error(std::string("Invalid value configured for ") + p->name);
     }
+
+    // dirty pages and in-flight I/O must leave room for everything else
+    if (MB(m_dirty_ratio) + m_dirty_ratio * m_buf_per_dirty_mb >= MB(100))
+        throw std::runtime_error("Invalid values configured for DIRTY_RATIO and BUF_PER_DIRTY_MB");
 }
 
 class HyperInfo {
@@ -699,9 +739,9 @@ class MemMap {
         /**
 	 * Initialize a new MemMap object.
 	 *
-	 * @param[in] procdir Mount point for procfs
+	 * @param[in] iomem Path to the physical memory map
 	 */
-        MemMap(const SizeConstants &sizes, const char *procdir = "/proc");
+        MemMap(const SizeConstants &sizes, const char *iomem = "/proc/iomem");
 
 	/**
 	 * Get the total System RAM (in bytes).
@@ -734,10 +774,10 @@ class MemMap {
         MemRange::Addr m_kstart, m_kend;
 };
 
-MemMap::MemMap(const SizeConstants &sizes, const char *procdir)
+MemMap::MemMap(const SizeConstants &sizes, const char *iomem)
     : m_sizes(sizes), m_kstart(0), m_kend(0)
 {
-	string path("/proc/iomem");
+	string path(iomem);
 
     ifstream f(path.c_str());
     if (!f)
@@ -932,6 +972,10 @@ static unsigned long runtimeSize(SizeConstants const &sizes,
     percpu += 3 * sizes.pagesize() / 1024; // makedumpfile BUF_PARALLEL and BUF_OUT_PARALLEL
     percpu += 128; // makedumpfile WRKMEM_PARALLEL
     percpu += 5;   // makedumpfile ZSTD_CCTX_PARALLEL
+    if (needsRawdump)
+        percpu += 2 * 2 * 1024 + 1024; // kdump-rawdump 2 slots and a zstd context
+    if (needsElfdump)
+        percpu += 2 * 1024; // kdump-elfdump 2 slots
 
     DEBUG("Per-cpu requirements: %lu KiB", percpu);
     percpu *= cpus;
@@ -942,6 +986,20 @@ static unsigned long runtimeSize(SizeConstants const &sizes,
     unsigned long user = sizes.user_base_kb();
     if (needsNetwork)
         user += sizes.user_net_kb();
+    if (needsNetStreams) {
+        // KDUMP_NET_STREAMS=0 means one upload stream per CPU
+        unsigned long streams = KDUMP_NET_STREAMS > 0 ?
+            KDUMP_NET_STREAMS : cpus;
+        DEBUG("Upload streams: %lu", streams);
+        user += (streams - 1) * NET_STREAM_KB;
+
+        // up to one segment per stream and the next one are kept in /tmp
+        if (KDUMP_NET_SEGMENT_SIZE > 0) {
+            unsigned long segments = (streams + 1) * MB(KDUMP_NET_SEGMENT_SIZE);
+            DEBUG("Upload segments: %lu KiB", segments);
+            user += segments;
+        }
+    }
 
     if (needsMakedumpfile) {
         // Estimate bitmap size (1 bit for every RAM page)
@@ -954,6 +1012,10 @@ static unsigned long runtimeSize(SizeConstants const &sizes,
         // Makedumpfile needs additional 96 B for every 128 MiB of RAM
         user += 96 * shr_round_up(memtotal, 20 + 7);
     }
+    if (needsRawdump) {
+        // kdump-rawdump keeps 8 bytes for every 1 MiB block of RAM
+        user += shr_round_up(memtotal, 17);
+    }
     DEBUG("Total userspace: %lu KiB", user);
     required += user;
 
@@ -965,10 +1027,12 @@ static unsigned long runtimeSize(SizeConstants const &sizes,
     //
     // solve the above using integer math:
     unsigned long dirty;
+    unsigned long dirty_ratio = sizes.dirty_ratio();
+    unsigned long buf_per_dirty_mb = sizes.buf_per_dirty_mb();
     prev = required;
     required = required * MB(100) /
-        (MB(100) - MB(DIRTY_RATIO) - DIRTY_RATIO * BUF_PER_DIRTY_MB);
-    dirty = (required - prev) * MB(1) / (MB(1) + BUF_PER_DIRTY_MB);
+        (MB(100) - MB(dirty_ratio) - dirty_ratio * buf_per_dirty_mb);
+    dirty = (required - prev) * MB(1) / (MB(1) + buf_per_dirty_mb);
     DEBUG("Dirty pagecache: %lu KiB", dirty);
     DEBUG("In-flight I/O: %lu KiB", required - prev - dirty);
 
@@ -1019,14 +1083,18 @@ int main(int argc, char* argv[])
 	int opt;
 	static option long_options[] = {
 		{"shrink", 0, 0, 's'},
+		{"iomem", 1, 0, 'm'},
 		{0, 0, 0, 0}
 	};
 
-	while ((opt = getopt_long(argc, argv, "ds", long_options, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "dsm:", long_options, NULL)) != -1) {
 	       switch (opt) {
 			case 's':
 				m_shrink = true;
 				break;
+			case 'm':
+				iomem_path = optarg;
+				break;
 			case 'd':
 				debug = true;
 				break;
@@ -1056,11 +1124,35 @@ int main(int argc, char* argv[])
 		if (!val || !*val)
 			throw std::runtime_error("KDUMP_PROTO not defined");
 		needsNetwork = strcmp(val, "file");
+		needsNetStreams = !strcmp(val, "ssh") || !strcmp(val, "sftp") ||
+			!strcmp(val, "ftp");
+
+		// dumps staged on a local disk are uploaded after reboot
+		val = std::getenv("KDUMP_STAGING_DIR");
+		if (val && *val)
+			needsNetwork = needsNetStreams = false;
+
+		val = std::getenv("KDUMP_NET_STREAMS");
+		if (val && *val) {
+			KDUMP_NET_STREAMS = strtoll(val, &end, 10);
+			if (*end || KDUMP_NET_STREAMS < 0)
+				throw std::runtime_error("KDUMP_NET_STREAMS invalid");
+		}
+
+		val = std::getenv("KDUMP_NET_SEGMENT_SIZE");
+		if (val && *val) {
+			KDUMP_NET_SEGMENT_SIZE = strtoll(val, &end, 10);
+			if (*end || KDUMP_NET_SEGMENT_SIZE < 0)
+				throw std::runtime_error("KDUMP_NET_SEGMENT_SIZE invalid");
+		}
 
 		val = std::getenv("KDUMP_DUMPFORMAT");
 		if (!val || !*val)
 			throw std::runtime_error("KDUMP_DUMPFORMAT not defined");
-		needsMakedumpfile = strcmp(val, "none") && strcmp(val, "raw");
+		needsMakedumpfile = strcmp(val, "none") && strcmp(val, "raw") &&
+			strcmp(val, "raw-zstd");
+		needsRawdump = !strcmp(val, "raw-zstd");
+		needsElfdump = !strcmp(val, "ELF");
 
 		val = std::getenv("KDUMP_KERNEL_VERSION");
 		if (val && *val)
@@ -1088,7 +1180,7 @@ int main(int argc, char* argv[])
     }
 
     SizeConstants sizes;
-    MemMap mm(sizes);
+    MemMap mm(sizes, iomem_path);
     unsigned long required;
     unsigned long memtotal = shr_round_up(mm.total(), 10);
 
@@ -70,6 +70,7 @@ BuildRequires:  cmake >= 3.7
 BuildRequires:  gcc-c++
 BuildRequires:  pkgconfig
 BuildRequires:  util-linux-systemd
+BuildRequires:  pkgconfig(libzstd)
 BuildRequires:  pkgconfig(systemd)
 BuildRequires:  pkgconfig(udev)
 #!BuildIgnore:  fop
@@ -197,6 +198,8 @@ ln -s %{_sbindir}/service %{buildroot}%{_sbindir}/rckdump
 %service_add_pre kdump.service
 %service_add_pre kdump-early.service
 %service_add_pre kdump-notify.service
+%service_add_pre kdump-upload.service
+%service_add_pre kdump-hotplug.service
 exit 0
 
 %post
@@ -210,6 +213,8 @@ fi
 %service_add_post kdump.service
 %service_add_post kdump-early.service
 %service_add_post kdump-notify.service
+%service_add_post kdump-upload.service
+%service_add_post kdump-hotplug.service
 # ensure newly added kdump-*.service is-enabled matches prior state
 if [ -x %{_bindir}/systemctl ] && %{_bindir}/systemctl is-enabled kdump.service &>/dev/null ; then
 	%{_bindir}/systemctl reenable kdump.service || :
@@ -242,7 +247,9 @@ echo "Stopping kdump ..."
 %service_del_preun kdump.service
 %service_del_preun kdump-early.service
 %service_del_preun kdump-notify.service
+%service_del_preun kdump-upload.service
 %service_del_preun kdump-commandline.service
+%service_del_preun kdump-hotplug.service
 exit 0
 
 %postun
@@ -258,7 +265,9 @@ fi
 %service_del_postun kdump.service
 %service_del_postun kdump-early.service
 %service_del_postun kdump-notify.service
+%service_del_postun kdump-upload.service
 %service_del_postun kdump-commandline.service
+%service_del_postun kdump-hotplug.service
 exit 0
 
 %files
@@ -279,7 +288,9 @@ exit 0
 %{_unitdir}/kdump.service
 %{_unitdir}/kdump-early.service
 %{_unitdir}/kdump-notify.service
+%{_unitdir}/kdump-upload.service
 %{_unitdir}/kdump-commandline.service
+%{_unitdir}/kdump-hotplug.service
 %{_sbindir}/rckdump
 %dir /var/lib/kdump
 